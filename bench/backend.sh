@@ -0,0 +1,68 @@
+#!/usr/bin/env bash
+#
+# Compare the sync and uring backends on a synthetic tree.
+#
+# Usage: bench/backend.sh [TMPFILESD] [DIRS] [FILES_PER_DIR] [WORKDIR]
+#
+# For each backend a fresh tree of DIRS directories holding FILES_PER_DIR
+# files each is aged out with --clean, then rebuilt and removed with R
+# and --remove. WORKDIR should live on the storage being evaluated.
+
+set -o errexit
+set -o nounset
+
+BIN=${1:-./tmpfilesd}
+DIRS=${2:-200}
+FILES=${3:-500}
+
+# a WORKDIR given by the caller is theirs to remove
+if [[ -n "${4:-}" ]]; then
+	WORK=$4
+else
+	WORK=$(mktemp -d)
+	trap 'rm -rf "${WORK}"' EXIT
+fi
+
+populate()
+{
+	local root=$1 d f
+
+	rm -rf "${root}"
+	mkdir -p "${root}/etc/tmpfiles.d"
+	for ((d = 0; d < DIRS; d++)); do
+		mkdir -p "${root}/tree/d${d}"
+		(cd "${root}/tree/d${d}" && for ((f = 0; f < FILES; f++)); do
+			: > "f${f}"
+		done)
+	done
+}
+
+run()
+{
+	local start end
+
+	sync
+	echo 3 > /proc/sys/vm/drop_caches 2>/dev/null || true
+	start=$(date +%s%N)
+	"$@" >/dev/null
+	end=$(date +%s%N)
+	echo $(( (end - start) / 1000000 ))
+}
+
+printf "%-8s %12s %12s\n" backend "clean (ms)" "remove (ms)"
+
+for backend in sync uring; do
+	root="${WORK}/${backend}"
+
+	populate "${root}"
+	echo "d /tree 0755 - - 1s" > "${root}/etc/tmpfiles.d/bench.conf"
+	sleep 2
+	clean=$(run "${BIN}" --clean --backend=${backend} --root="${root}")
+
+	populate "${root}"
+	echo "R /tree" > "${root}/etc/tmpfiles.d/bench.conf"
+	remove=$(run "${BIN}" --remove --backend=${backend} --root="${root}")
+
+	printf "%-8s %12s %12s\n" ${backend} ${clean} ${remove}
+	rm -rf "${root}"
+done
@@ -0,0 +1,34 @@
+#!/usr/bin/env bash
+#
+# Generate a reproducible tmpfiles.d config set.
+#
+# Usage: bench/gen-config.sh ROOT FILES LINES
+#
+# Writes FILES configs of LINES lines each to ROOT/etc/tmpfiles.d. Every
+# config gets its own folder below /bench/cfg and cycles through d, f, L,
+# p, z (with a glob) and x lines in it.
+
+set -o errexit
+set -o nounset
+
+ROOT=$1
+FILES=$2
+LINES=$3
+
+mkdir -p "${ROOT}/etc/tmpfiles.d"
+
+for ((c = 0; c < FILES; c++)); do
+	awk -v c=${c} -v n=${LINES} 'BEGIN {
+		dir = sprintf("/bench/cfg/c%d", c)
+		printf "d %s 0755 - -\n", dir
+		for (i = 1; i < n; i++) {
+			k = i % 6
+			if (k == 0)      printf "d %s/d%d 0755 - - 1d\n", dir, i
+			else if (k == 1) printf "f %s/f%d 0644 - -\n", dir, i
+			else if (k == 2) printf "L %s/l%d - - - - %s/f%d\n", dir, i, dir, i - 1
+			else if (k == 3) printf "p %s/p%d 0644 - -\n", dir, i
+			else if (k == 4) printf "z %s/f*%d 0644 - -\n", dir, i - 3
+			else             printf "x %s/d%d\n", dir, i - 5
+		}
+	}' > "${ROOT}/etc/tmpfiles.d/bench-$(printf %05d ${c}).conf"
+done
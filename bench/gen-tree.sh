@@ -0,0 +1,48 @@
+#!/usr/bin/env bash
+#
+# Populate a reproducible directory tree.
+#
+# Usage: bench/gen-tree.sh DIR flat|deep COUNT [PREFIX] [DEPTH]
+#
+# flat puts COUNT empty files named PREFIXn into subdirectories of DIR,
+# 1000 to a directory. deep spreads them over a chain of DEPTH (default
+# 32) nested directories. Running it again with another PREFIX adds
+# files, so calling it once, waiting out an age and calling it again
+# gives a tree with a known share of old entries.
+
+set -o errexit
+set -o nounset
+
+DIR=$1
+SHAPE=$2
+COUNT=$3
+PREFIX=${4:-f}
+DEPTH=${5:-32}
+
+fill()
+{
+	local dir=$1 from=$2 to=$3
+
+	mkdir -p "${dir}"
+	(cd "${dir}" && seq -f "${PREFIX}%.0f" ${from} $((to - 1)) | xargs -r touch)
+}
+
+case ${SHAPE} in
+	flat)
+		for ((i = 0; i < COUNT; i += 1000)); do
+			fill "${DIR}/s$((i / 1000))" ${i} $((i + 1000 < COUNT ? i + 1000 : COUNT))
+		done
+		;;
+	deep)
+		per=$(( (COUNT + DEPTH - 1) / DEPTH ))
+		dir=${DIR}
+		for ((l = 0, i = 0; l < DEPTH && i < COUNT; l++, i += per)); do
+			dir=${dir}/l${l}
+			fill "${dir}" ${i} $((i + per < COUNT ? i + per : COUNT))
+		done
+		;;
+	*)
+		echo "unknown shape: ${SHAPE}" >&2
+		exit 1
+		;;
+esac
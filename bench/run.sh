@@ -0,0 +1,102 @@
+#!/usr/bin/env bash
+#
+# Time the parse, create, clean and remove phases on generated workloads.
+#
+# Usage: bench/run.sh [TMPFILESD]
+#
+# The workload is sized from the environment:
+#
+#   CONFIGS  config files to parse and create from       (default 100)
+#   LINES    lines per config file                        (default 100)
+#   FILES    files in each of the flat and deep trees     (default 20000)
+#   DEPTH    directory levels of the deep tree            (default 32)
+#   OLD      percentage of tree files old enough to clean (default 50)
+#   WORK     directory to create the scratch --root in    (default $TMPDIR)
+#
+# Trees are aged by creating the old share, waiting out a 2s age and then
+# adding the rest, as ctime cannot be set back. Every measurement is one
+# line with fixed columns, so runs can be compared with diff.
+
+set -o errexit
+set -o nounset
+
+BIN=$(realpath "${1:-./tmpfilesd}")
+CONFIGS=${CONFIGS:-100}
+LINES=${LINES:-100}
+FILES=${FILES:-20000}
+DEPTH=${DEPTH:-32}
+OLD=${OLD:-50}
+WORK=$(mktemp -d -p "${WORK:-${TMPDIR:-/tmp}}" bench.XXXXXX)
+BENCH=$(dirname "$0")
+AGE=2
+
+# count KEY: sum KEY over all rule types of the --stats=json line on stdin
+count()
+{
+	sed 's/,"files":.*//' | grep -o "\"$1\":[0-9]*" | awk -F: '{ n += $2 } END { print n + 0 }'
+}
+
+# phase NAME: wall and cpu milliseconds of phase NAME
+phase()
+{
+	sed -n "s/.*\"$1\":{\"wall_seconds\":\([0-9.]*\),\"cpu_seconds\":\([0-9.]*\)}.*/\1 \2/p" |
+		awk '{ printf "%.1f %.1f\n", $1 * 1000, $2 * 1000 }'
+}
+
+# run PHASE WORKLOAD STATS-PHASE ROOT ARGS...
+run()
+{
+	local name=$1 load=$2 stat=$3 root=$4 json
+
+	shift 4
+	sync
+	json=$("${BIN}" --root="${root}" --stats=json -q "$@" | tail -n 1)
+	printf "%-8s %-16s %10s %10s %10s %10s %10s\n" "${name}" "${load}" \
+		$(phase "${stat}" <<< "${json}") \
+		$(count examined <<< "${json}") \
+		$(count removed <<< "${json}") \
+		$(count created <<< "${json}")
+}
+
+# trees ROOT PREFIX COUNT: add COUNT files to the flat and deep trees
+trees()
+{
+	"${BENCH}/gen-tree.sh" "$1/tree/flat" flat "$3" "$2"
+	"${BENCH}/gen-tree.sh" "$1/tree/deep" deep "$3" "$2" "${DEPTH}"
+}
+
+# aged ROOT: rebuild both trees with OLD percent of files past AGE
+aged()
+{
+	local old=$((FILES * OLD / 100))
+
+	rm -rf "$1/tree"
+	trees "$1" o "${old}"
+	sleep $((AGE + 1))
+	trees "$1" y $((FILES - old))
+}
+
+trap 'rm -rf "${WORK}"' EXIT
+
+cfg=${WORK}/config
+tree=${WORK}/tree
+
+"${BENCH}/gen-config.sh" "${cfg}" "${CONFIGS}" "${LINES}"
+mkdir -p "${tree}/etc/tmpfiles.d"
+
+echo "# configs=${CONFIGS} lines=${LINES} files=${FILES} depth=${DEPTH} old=${OLD}%"
+printf "%-8s %-16s %10s %10s %10s %10s %10s\n" \
+	"# phase" workload wall_ms cpu_ms examined removed created
+
+run parse  "${CONFIGS}x${LINES}" parse   "${cfg}"
+run create "${CONFIGS}x${LINES}" execute "${cfg}" --create
+
+printf "d /tree/flat - - - %ds\nd /tree/deep - - - %ds\n" ${AGE} ${AGE} \
+	> "${tree}/etc/tmpfiles.d/bench.conf"
+aged "${tree}"
+run clean  "flat+deep" clean "${tree}" --clean
+
+printf "R /tree/flat\nR /tree/deep\n" > "${tree}/etc/tmpfiles.d/bench.conf"
+rm -rf "${tree}/tree"
+trees "${tree}" f "${FILES}"
+run remove "flat+deep" execute "${tree}" --remove
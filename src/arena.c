@@ -0,0 +1,100 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "arena.h"
+
+/*
+ * A bump allocator for strings and tables that live for the whole run.
+ * Nothing is freed individually, arena_free() releases every chunk at
+ * once when the program exits.
+ */
+
+#define ARENA_CHUNK	(64 * 1024)
+#define ARENA_ALIGN	8
+
+typedef struct chunk {
+	struct chunk *next;
+	size_t used;
+	size_t size;
+	long long data[];	/* keeps data ARENA_ALIGN aligned */
+} chunk_t;
+
+static chunk_t *chunks = NULL;
+
+static chunk_t *new_chunk(size_t len)
+{
+	chunk_t *c;
+	size_t size = len > ARENA_CHUNK ? len : ARENA_CHUNK;
+
+	if ( !(c = malloc(sizeof(chunk_t) + size)) )
+		err(1, "malloc");
+
+	c->used = 0;
+	c->size = size;
+
+	return c;
+}
+
+void *arena_alloc(size_t len)
+{
+	chunk_t *c;
+	void *ret;
+
+	len = (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (!chunks || chunks->size - chunks->used < len) {
+		c = new_chunk(len);
+
+		/* an oversized allocation must not retire a partly used chunk */
+		if (chunks && len > ARENA_CHUNK) {
+			c->next = chunks->next;
+			chunks->next = c;
+			c->used = len;
+			return (char *)c->data;
+		}
+
+		c->next = chunks;
+		chunks = c;
+	}
+
+	ret = (char *)chunks->data + chunks->used;
+	chunks->used += len;
+
+	return ret;
+}
+
+char *arena_strndup(const char *str, size_t len)
+{
+	char *ret;
+
+	if (!str)
+		return NULL;
+
+	ret = arena_alloc(len + 1);
+	memcpy(ret, str, len);
+	ret[len] = '\0';
+
+	return ret;
+}
+
+char *arena_strdup(const char *str)
+{
+	if (!str)
+		return NULL;
+
+	return arena_strndup(str, strlen(str));
+}
+
+void arena_free(void)
+{
+	chunk_t *c;
+
+	while ( (c = chunks) )
+	{
+		chunks = c->next;
+		free(c);
+	}
+}
@@ -0,0 +1,11 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+void *arena_alloc(size_t len);
+char *arena_strdup(const char *str);
+char *arena_strndup(const char *str, size_t len);
+void arena_free(void);
+
+#endif
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#include "budget.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * Limits on what cleaning and removal may cost.
+ *
+ * The I/O priority and nice value are set on the main thread before any
+ * worker is started, and the workers inherit them. Every metadata
+ * operation the clean and remove loops issue takes a token from a bucket
+ * refilled at --max-ops-per-sec, holding at most one second's worth, and
+ * sleeps when it is empty. Past the --max-runtime deadline no more tokens
+ * are handed out, and the loops stop where they are.
+ */
+
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_PRIO(c, d)	(((c) << IOPRIO_CLASS_SHIFT) | (d))
+
+static int ioprio = -1;
+static int niceval = 0;
+static bool do_nice = false;
+static double rate = 0;
+static double tokens = 0;
+static struct timespec last;
+static struct timeval runtime;
+static struct timespec deadline;
+static bool has_deadline = false;
+static bool expired = false;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* "idle" or "be:N" with N from 0 (highest) to 7 */
+int budget_ioprio(const char *spec)
+{
+	if ( !strcmp(spec, "idle") ) {
+		ioprio = IOPRIO_PRIO(IOPRIO_CLASS_IDLE, 0);
+		return 0;
+	}
+
+	if ( strncmp(spec, "be:", 3) || strlen(spec) != 4 ||
+			spec[3] < '0' || spec[3] > '7' )
+		return -1;
+
+	ioprio = IOPRIO_PRIO(IOPRIO_CLASS_BE, spec[3] - '0');
+	return 0;
+}
+
+int budget_nice(const char *spec)
+{
+	const char *t = spec;
+
+	if (*t == '-' || *t == '+')
+		t++;
+	if ( !*t || !isnumber(t) || (niceval = atoi(spec)) < -20 || niceval > 19 )
+		return -1;
+
+	do_nice = true;
+	return 0;
+}
+
+void budget_rate(unsigned long ops_per_sec)
+{
+	rate = ops_per_sec;
+	tokens = rate;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+}
+
+void budget_runtime(const struct timeval *tv)
+{
+	runtime = *tv;
+	has_deadline = true;
+}
+
+void budget_apply(void)
+{
+	if (ioprio != -1 &&
+			syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == -1)
+		log_warn("ioprio_set");
+
+	if (do_nice && setpriority(PRIO_PROCESS, 0, niceval) == -1)
+		log_warn("setpriority");
+}
+
+static double elapsed(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/*
+ * Start a new --max-runtime period. A one shot run has one, the daemon
+ * one for every tree it cleans.
+ */
+void budget_start(void)
+{
+	if (!has_deadline)
+		return;
+
+	pthread_mutex_lock(&lock);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += runtime.tv_sec;
+	deadline.tv_nsec += runtime.tv_usec * 1000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	__atomic_store_n(&expired, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Wait until n more operations fit the rate. Returns -1, without waiting,
+ * once they would not be done before the deadline.
+ */
+int budget_take(unsigned n)
+{
+	struct timespec now, ts;
+	double wait = 0;
+
+	if (!rate && !has_deadline)
+		return 0;
+
+	pthread_mutex_lock(&lock);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (rate) {
+		tokens += elapsed(&last, &now) * rate;
+		if (tokens > rate)
+			tokens = rate;
+		last = now;
+		if ( (tokens -= n) < 0 )
+			wait = -tokens / rate;
+	}
+
+	if (has_deadline && !expired && elapsed(&now, &deadline) < wait) {
+		__atomic_store_n(&expired, true, __ATOMIC_RELAXED);
+		log_msg(LV_WARN, "out of time, leaving the rest for the next run");
+	}
+
+	if (expired) {
+		/* not spent after all */
+		tokens += n;
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	/* a signal cuts it short, so stopping is not held up */
+	if (wait > 0) {
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+	}
+
+	return 0;
+}
+
+/* checked for every entry, so without the lock */
+int budget_expired(void)
+{
+	return __atomic_load_n(&expired, __ATOMIC_RELAXED);
+}
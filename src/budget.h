@@ -0,0 +1,15 @@
+#ifndef _BUDGET_H
+#define _BUDGET_H
+
+#include <sys/time.h>
+
+int budget_ioprio(const char *spec);
+int budget_nice(const char *spec);
+void budget_rate(unsigned long ops_per_sec);
+void budget_runtime(const struct timeval *tv);
+void budget_apply(void);
+void budget_start(void);
+int budget_take(unsigned n);
+int budget_expired(void);
+
+#endif
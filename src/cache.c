@@ -0,0 +1,421 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cache.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * Compiled rule cache.
+ *
+ * The file is a header, a table of dependencies (every config file and
+ * folder that was read while compiling, plus the passwd/group files used
+ * to resolve names), a table of fixed size rules and a string table that
+ * the other sections refer to by offset. A cache is only used when the
+ * key (root and explicit config files) matches and every dependency still
+ * has the same device, inode, size and mtime, or is still absent.
+ */
+
+#define CACHE_MAGIC		"TMPFDC\0"
+#define CACHE_VERSION	1
+#define CACHE_NONE		UINT32_MAX
+
+struct cache_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t key;
+	uint32_t ndeps;
+	uint32_t nrules;
+	uint32_t strsz;
+	uint32_t pad;
+};
+
+struct cache_dep {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t path;
+	uint32_t absent;
+};
+
+struct cache_rule {
+	uint32_t path;
+	uint32_t arg;
+	uint32_t file;
+	uint32_t line;
+	uint32_t flags;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	int64_t age_sec;
+	int64_t age_usec;
+	char type;
+	char suff;
+	uint8_t act;
+	uint8_t pad[5];
+};
+
+static char *cache_path = NULL;
+static char *cache_key = NULL;
+static struct cache_dep *deps = NULL;
+static char **dep_paths = NULL;
+static size_t ndeps = 0;
+
+void cache_init(const char *path, const char *key)
+{
+	if ( !(cache_path = strdup(path)) || !(cache_key = strdup(key)) )
+		err(1, "strdup");
+}
+
+int cache_enabled(void)
+{
+	return cache_path != NULL;
+}
+
+static void fill_dep(struct cache_dep *dep, const char *path)
+{
+	struct stat sb;
+
+	memset(dep, 0, sizeof(struct cache_dep));
+
+	if (stat(path, &sb) == -1) {
+		dep->absent = 1;
+		return;
+	}
+
+	dep->dev = sb.st_dev;
+	dep->ino = sb.st_ino;
+	dep->size = sb.st_size;
+	dep->mtime_sec = sb.st_mtim.tv_sec;
+	dep->mtime_nsec = sb.st_mtim.tv_nsec;
+}
+
+/*
+ * Record a file or folder the compiled rules depend on. This is called
+ * before the file is read, so a change made while reading it leaves an
+ * older mtime behind and only causes a needless recompile.
+ */
+void cache_track(const char *path)
+{
+	struct cache_dep *tmp;
+	char **tmpp;
+
+	if (!cache_path || !path)
+		return;
+
+	if ( !(tmp = realloc(deps, sizeof(struct cache_dep) * (ndeps + 1))) ) {
+		log_warn("realloc");
+		return;
+	}
+	deps = tmp;
+
+	if ( !(tmpp = realloc(dep_paths, sizeof(char *) * (ndeps + 1))) ) {
+		log_warn("realloc");
+		return;
+	}
+	dep_paths = tmpp;
+
+	if ( !(dep_paths[ndeps] = strdup(path)) ) {
+		log_warn("strdup");
+		return;
+	}
+
+	fill_dep(&deps[ndeps], path);
+	ndeps++;
+}
+
+/*
+ * Forget every tracked dependency, before the configs are read again.
+ */
+void cache_reset(void)
+{
+	for (size_t i = 0; i < ndeps; i++)
+		free(dep_paths[i]);
+	free(dep_paths);
+	free(deps);
+	dep_paths = NULL;
+	deps = NULL;
+	ndeps = 0;
+}
+
+static const char *cstr(const char *strs, uint32_t strsz, uint32_t off)
+{
+	if (off == CACHE_NONE || off >= strsz)
+		return NULL;
+
+	return strs + off;
+}
+
+/*
+ * Map the cache and, if it is still fresh, point *rules at a table built
+ * from it. The strings stay in the mapping for the rest of the run.
+ * Returns 0 if the cache was used, -1 if the configs must be parsed.
+ */
+int cache_load(rule_t **rules, size_t *nrules)
+{
+	const struct cache_hdr *hdr;
+	const struct cache_dep *cdep;
+	const struct cache_rule *crule;
+	const char *strs, *key;
+	struct cache_dep cur;
+	struct stat sb;
+	rule_t *ret;
+	size_t need;
+	void *map;
+	uint32_t i;
+	int fd;
+
+	if (!cache_path)
+		return -1;
+
+	if ( (fd = open(cache_path, O_RDONLY)) == -1 ) {
+		if (errno != ENOENT)
+			log_warn("open(%s)", cache_path);
+		return -1;
+	}
+
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(struct cache_hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		log_warn("mmap(%s)", cache_path);
+		return -1;
+	}
+
+	hdr = map;
+
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) ||
+			hdr->version != CACHE_VERSION)
+		goto stale;
+
+	need = sizeof(struct cache_hdr) +
+		(size_t)hdr->ndeps * sizeof(struct cache_dep) +
+		(size_t)hdr->nrules * sizeof(struct cache_rule) +
+		hdr->strsz;
+
+	if (need != (size_t)sb.st_size || !hdr->strsz)
+		goto stale;
+
+	cdep = (const struct cache_dep *)(hdr + 1);
+	crule = (const struct cache_rule *)(cdep + hdr->ndeps);
+	strs = (const char *)(crule + hdr->nrules);
+
+	if (strs[hdr->strsz - 1] != '\0')
+		goto stale;
+
+	if ( !(key = cstr(strs, hdr->strsz, hdr->key)) || strcmp(key, cache_key) )
+		goto stale;
+
+	for (i = 0; i < hdr->ndeps; i++)
+	{
+		const char *path = cstr(strs, hdr->strsz, cdep[i].path);
+
+		if (!path)
+			goto stale;
+
+		fill_dep(&cur, path);
+
+		if (cur.absent != cdep[i].absent)
+			goto stale;
+		if (cur.absent)
+			continue;
+		if (cur.dev != cdep[i].dev || cur.ino != cdep[i].ino ||
+				cur.size != cdep[i].size ||
+				cur.mtime_sec != cdep[i].mtime_sec ||
+				cur.mtime_nsec != cdep[i].mtime_nsec)
+			goto stale;
+	}
+
+	if ( !(ret = calloc(hdr->nrules ? hdr->nrules : 1, sizeof(rule_t))) ) {
+		log_warn("calloc");
+		goto stale;
+	}
+
+	for (i = 0; i < hdr->nrules; i++)
+	{
+		ret[i].path = cstr(strs, hdr->strsz, crule[i].path);
+		ret[i].arg = cstr(strs, hdr->strsz, crule[i].arg);
+		ret[i].file = cstr(strs, hdr->strsz, crule[i].file);
+		ret[i].line = crule[i].line;
+		ret[i].flags = crule[i].flags;
+		ret[i].mode = crule[i].mode;
+		ret[i].uid = crule[i].uid;
+		ret[i].gid = crule[i].gid;
+		ret[i].age.tv_sec = crule[i].age_sec;
+		ret[i].age.tv_usec = crule[i].age_usec;
+		ret[i].type = crule[i].type;
+		ret[i].suff = crule[i].suff;
+		ret[i].act = crule[i].act;
+
+		if (!ret[i].path || !ret[i].file || ret[i].act > MAX_TYPE) {
+			free(ret);
+			goto stale;
+		}
+	}
+
+	*rules = ret;
+	*nrules = hdr->nrules;
+	return 0;
+
+stale:
+	munmap(map, sb.st_size);
+	return -1;
+}
+
+typedef struct strtab {
+	char *buf;
+	size_t len;
+	size_t size;
+} strtab_t;
+
+static uint32_t strtab_add(strtab_t *st, const char *str)
+{
+	size_t len, off;
+	char *tmp;
+
+	if (!str)
+		return CACHE_NONE;
+
+	len = strlen(str) + 1;
+
+	if (st->len + len > st->size) {
+		size_t size = MAX(st->size * 2, st->len + len);
+
+		if ( !(tmp = realloc(st->buf, size)) )
+			err(1, "realloc");
+		st->buf = tmp;
+		st->size = size;
+	}
+
+	off = st->len;
+	memcpy(st->buf + off, str, len);
+	st->len += len;
+
+	return off;
+}
+
+/*
+ * Write the rules and the recorded dependencies to a temporary file and
+ * rename it over the cache, so a concurrent reader never sees a partial
+ * cache.
+ */
+int cache_save(const rule_t *rules, size_t nrules)
+{
+	struct cache_hdr hdr;
+	struct cache_rule *crules = NULL;
+	strtab_t st = { NULL, 0, 0 };
+	const char *lastfile = NULL;
+	uint32_t lastoff = CACHE_NONE;
+	char *tmp = NULL;
+	size_t i, len;
+	int fd = -1, ret = -1;
+
+	if (!cache_path)
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHE_VERSION;
+	hdr.ndeps = ndeps;
+	hdr.nrules = nrules;
+	hdr.key = strtab_add(&st, cache_key);
+
+	for (i = 0; i < ndeps; i++)
+		deps[i].path = strtab_add(&st, dep_paths[i]);
+
+	if ( nrules && !(crules = calloc(nrules, sizeof(struct cache_rule))) ) {
+		log_warn("calloc");
+		goto done;
+	}
+
+	for (i = 0; i < nrules; i++)
+	{
+		/* rules from one file are contiguous, share its name */
+		if (rules[i].file != lastfile) {
+			lastfile = rules[i].file;
+			lastoff = strtab_add(&st, lastfile);
+		}
+
+		crules[i].path = strtab_add(&st, rules[i].path);
+		crules[i].arg = strtab_add(&st, rules[i].arg);
+		crules[i].file = lastoff;
+		crules[i].line = rules[i].line;
+		crules[i].flags = rules[i].flags;
+		crules[i].mode = rules[i].mode;
+		crules[i].uid = rules[i].uid;
+		crules[i].gid = rules[i].gid;
+		crules[i].age_sec = rules[i].age.tv_sec;
+		crules[i].age_usec = rules[i].age.tv_usec;
+		crules[i].type = rules[i].type;
+		crules[i].suff = rules[i].suff;
+		crules[i].act = rules[i].act;
+	}
+
+	hdr.strsz = st.len;
+
+	len = strlen(cache_path) + sizeof(".XXXXXX");
+	if ( !(tmp = malloc(len)) ) {
+		log_warn("malloc");
+		goto done;
+	}
+	snprintf(tmp, len, "%s.XXXXXX", cache_path);
+
+	if ( (fd = mkstemp(tmp)) == -1 ) {
+		log_warn("mkstemp(%s)", tmp);
+		goto done;
+	}
+
+	if ( write_all(fd, &hdr, sizeof(hdr)) ||
+			write_all(fd, deps, sizeof(struct cache_dep) * ndeps) ||
+			write_all(fd, crules, sizeof(struct cache_rule) * nrules) ||
+			write_all(fd, st.buf, st.len) ) {
+		log_warn("write(%s)", tmp);
+		unlink(tmp);
+		goto done;
+	}
+
+	if ( fchmod(fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH) )
+		log_warn("fchmod(%s)", tmp);
+
+	if ( close(fd) ) {
+		fd = -1;
+		log_warn("close(%s)", tmp);
+		unlink(tmp);
+		goto done;
+	}
+	fd = -1;
+
+	if ( rename(tmp, cache_path) ) {
+		log_warn("rename(%s)", cache_path);
+		unlink(tmp);
+		goto done;
+	}
+
+	ret = 0;
+
+done:
+	if (fd != -1)
+		close(fd);
+	free(tmp);
+	free(crules);
+	free(st.buf);
+	return ret;
+}
@@ -0,0 +1,13 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include "rule.h"
+
+void cache_init(const char *path, const char *key);
+int cache_enabled(void);
+void cache_track(const char *path);
+void cache_reset(void);
+int cache_load(rule_t **rules, size_t *nrules);
+int cache_save(const rule_t *rules, size_t nrules);
+
+#endif
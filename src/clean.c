@@ -0,0 +1,607 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+
+#include "clean.h"
+#include "dirstream.h"
+#include "dircache.h"
+#include "iobackend.h"
+#include "state.h"
+#include "budget.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
+
+/*
+ * Age based cleanup for the Age field of d, D and v rules.
+ *
+ * Directories are read with large getdents64() batches. An entry is only
+ * stat()ed when its type or age actually matters, and then with statx()
+ * asking for the type and timestamps only. Every entry is compared against
+ * a single "now" taken by clean_init() for the whole pass. The statx() and
+ * unlinkat() calls for up to CLEAN_BATCH entries of a directory go to the
+ * I/O backend together.
+ *
+ * A file is old when its atime, mtime, ctime and btime are all older than
+ * the age; for directories the ctime is not considered, as it changes
+ * whenever an entry is removed from them. A directory is removed once it
+ * is old and, after cleaning, empty. The walk never crosses into another
+ * file system.
+ *
+ * With a state file, each directory that was scanned completely is
+ * recorded with the oldest timestamp left below it, and a subtree whose
+ * record still matches is skipped while that is younger than the age.
+ * Any failure below a directory leaves it unrecorded so it is looked at
+ * again.
+ *
+ * As in rmtree, only the CLEAN_MAXFDS innermost levels keep their
+ * directory open. An outer one is closed with its read position saved,
+ * and reopened through ".." of its child when the walk returns to it,
+ * checking that it is still the same directory. Levels below that depth
+ * also read and batch in smaller steps, so a deep tree costs little more
+ * memory per level than its path.
+ */
+
+#define CLEAN_BUFSZ	(64 * 1024)
+#define CLEAN_BATCH	64
+#define CLEAN_MAXFDS	128
+#define CLEAN_DEEP_BUFSZ	(8 * 1024)
+#define CLEAN_DEEP_BATCH	8
+#define CLEAN_MASK	(STATX_TYPE|STATX_MODE|STATX_ATIME|STATX_MTIME| \
+		STATX_CTIME|STATX_BTIME|STATX_BLOCKS)
+
+/* a directory being read, one per level of the walk */
+typedef struct clevel {
+	dstream_t ds;
+	uint64_t ino;
+	off_t pos;		/* of ds while its fd is closed */
+	struct clevel *up;
+} clevel_t;
+
+typedef struct cctx {
+	struct statx_timestamp cutoff;
+	struct statx_timestamp age;
+	struct statx_timestamp due;
+	struct statx_timestamp oldest;	/* of the directory being read */
+	bool has_due;
+	bool has_oldest;
+	bool incomplete;
+	bool use_state;
+	bool unconditional;
+	bool subonly;
+	unsigned dev_major;
+	unsigned dev_minor;
+	clean_ign_fn ignored;
+	clevel_t *level;	/* innermost */
+	char path[PATH_MAX];
+} cctx_t;
+
+typedef struct centry {
+	char name[NAME_MAX + 1];
+	unsigned char type;
+	bool keep;
+	bool skip;
+	struct statx stx;
+} centry_t;
+
+static struct timespec now;
+static volatile sig_atomic_t stopping = 0;
+
+void clean_init(void)
+{
+	clock_gettime(CLOCK_REALTIME, &now);
+}
+
+/* stop cleaning as soon as possible, safe to call from a signal handler */
+void clean_stop(void)
+{
+	stopping = 1;
+}
+
+static bool halted(void)
+{
+	return stopping || budget_expired();
+}
+
+static bool ts_less(const struct statx_timestamp *a,
+		const struct statx_timestamp *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * An entry is old once the newest of its timestamps is older than the
+ * cutoff. One that is not yet old comes due when that timestamp reaches
+ * the age, which is remembered in c->due if it is the earliest so far.
+ */
+static bool is_old(cctx_t *c, const struct statx *stx, bool dir)
+{
+	struct statx_timestamp t;
+
+	if (c->unconditional)
+		return true;
+
+	t = stx->stx_atime;
+	if (ts_less(&t, &stx->stx_mtime))
+		t = stx->stx_mtime;
+	if (!dir && ts_less(&t, &stx->stx_ctime))
+		t = stx->stx_ctime;
+	if ((stx->stx_mask & STATX_BTIME) && ts_less(&t, &stx->stx_btime))
+		t = stx->stx_btime;
+
+	if (ts_less(&t, &c->cutoff))
+		return true;
+
+	if (!c->has_oldest || ts_less(&t, &c->oldest))
+		c->oldest = t;
+	c->has_oldest = true;
+
+	t.tv_sec += c->age.tv_sec;
+	t.tv_nsec += c->age.tv_nsec;
+	if (t.tv_nsec >= 1000000000) {
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000;
+	}
+
+	if (!c->has_due || ts_less(&t, &c->due))
+		c->due = t;
+	c->has_due = true;
+
+	return false;
+}
+
+static void clean_at(cctx_t *c, int dfd, uint64_t ino, size_t plen,
+		int depth);
+
+/*
+ * Whether the directory at c->path, with inode ino and ctime ctime, need
+ * not be read: its record matches and nothing below it is old yet. What
+ * the record says is left below it then counts as if it had been read.
+ *
+ * Only this directory is checked, not the ones below it; see state.c for
+ * what that misses.
+ */
+static bool can_skip(cctx_t *c, uint64_t ino, const struct statx_timestamp *ctime)
+{
+	struct statx stx;
+	dstate_t st;
+
+	if (!c->use_state || state_get(c->path, &st))
+		return false;
+
+	if (st.ino != ino || st.ctime_sec != ctime->tv_sec ||
+			st.ctime_nsec != ctime->tv_nsec)
+		return false;
+
+	if (st.oldest_sec == STATE_EMPTY)
+		return true;
+
+	/* as if the oldest timestamp were an entry's */
+	memset(&stx, 0, sizeof(stx));
+	stx.stx_atime.tv_sec = st.oldest_sec;
+	stx.stx_atime.tv_nsec = st.oldest_nsec;
+
+	return !is_old(c, &stx, true);
+}
+
+/* record the directory just read on dfd, unless something was missed */
+static void record(cctx_t *c, int dfd)
+{
+	struct stat sb;
+	dstate_t st;
+
+	if (!c->use_state || c->incomplete || halted())
+		return;
+
+	if (fstat(dfd, &sb) == -1) {
+		c->incomplete = true;
+		return;
+	}
+
+	st.ino = sb.st_ino;
+	st.ctime_sec = sb.st_ctim.tv_sec;
+	st.ctime_nsec = sb.st_ctim.tv_nsec;
+	st.oldest_sec = c->has_oldest ? c->oldest.tv_sec : STATE_EMPTY;
+	st.oldest_nsec = c->has_oldest ? c->oldest.tv_nsec : 0;
+
+	state_put(c->path, &st);
+	state_checkpoint();
+}
+
+/* point c->path at the entry name of the directory at c->path[0..plen] */
+static const char *entry_path(cctx_t *c, size_t plen, const char *name)
+{
+	c->path[plen] = '/';
+	strcpy(c->path + plen + 1, name);
+	return c->path;
+}
+
+/* close the directory of l, to be reopened by unpark() */
+static void park(clevel_t *l)
+{
+	if ( (l->pos = lseek(l->ds.fd, 0, SEEK_CUR)) == -1 )
+		return;
+
+	close(l->ds.fd);
+	l->ds.fd = -1;
+}
+
+/* reopen the parked directory of l from its child directory cfd */
+static int unpark(cctx_t *c, clevel_t *l, int cfd)
+{
+	struct stat sb;
+	int fd;
+
+	if ( (fd = openat(cfd, "..", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1 ) {
+		log_warn("open(%s/..)", c->path);
+		return -1;
+	}
+
+	if (fstat(fd, &sb) == -1 || major(sb.st_dev) != c->dev_major ||
+			minor(sb.st_dev) != c->dev_minor || sb.st_ino != l->ino) {
+		log_warnx("%s: directory moved during cleaning", c->path);
+		close(fd);
+		return -1;
+	}
+
+	if (lseek(fd, l->pos, SEEK_SET) == -1) {
+		log_warn("lseek(%s/..)", c->path);
+		close(fd);
+		return -1;
+	}
+
+	l->ds.fd = fd;
+	return 0;
+}
+
+/*
+ * Deal with n entries of the directory of level l: stat and unlink in one
+ * batch each, then descend into the subdirectories one by one.
+ */
+static void clean_batch(cctx_t *c, clevel_t *l, size_t plen, int depth,
+		centry_t *ents, ioop_t *ops, size_t n)
+{
+	centry_t *e;
+	size_t i, k;
+	bool old;
+	int dfd = l->ds.fd, sfd, res;
+
+	for (i = k = 0; i < n; i++)
+	{
+		e = &ents[i];
+		e->skip = false;
+
+		/* a file that goes no matter its age needs no stat */
+		if (e->type != DT_UNKNOWN && e->type != DT_DIR && c->unconditional) {
+			memset(&e->stx, 0, sizeof(struct statx));
+			e->stx.stx_mode = DTTOIF(e->type);
+			continue;
+		}
+
+		ops[k++] = (ioop_t){ .op = IO_STATX, .dfd = dfd, .path = e->name,
+			.flags = AT_SYMLINK_NOFOLLOW|AT_NO_AUTOMOUNT, .mode = CLEAN_MASK,
+			.stx = &e->stx };
+	}
+
+	if (budget_take(k))
+		goto halt;
+	io_submit(ops, k);
+
+	for (i = 0; i < k; i++)
+	{
+		if (ops[i].res >= 0)
+			continue;
+		e = (centry_t *)((char *)ops[i].stx - offsetof(centry_t, stx));
+		e->skip = true;
+		if ( (errno = -ops[i].res) != ENOENT ) {
+			log_warn("statx(%s)", entry_path(c, plen, e->name));
+			metrics_add(M_ERRORS, 1);
+			c->incomplete = true;
+		}
+	}
+
+	for (i = k = 0; i < n; i++)
+	{
+		e = &ents[i];
+		if (e->skip || e->keep || S_ISDIR(e->stx.stx_mode) ||
+				!is_old(c, &e->stx, false))
+			continue;
+		ops[k++] = (ioop_t){ .op = IO_UNLINK, .dfd = dfd, .path = e->name };
+	}
+
+	if (budget_take(k))
+		goto halt;
+	io_submit(ops, k);
+
+	for (i = 0; i < k; i++)
+	{
+		c->path[plen] = '\0';
+		TRACE3(clean__unlink, c->path, ops[i].path, ops[i].res);
+
+		if (!ops[i].res) {
+			e = (centry_t *)(ops[i].path - offsetof(centry_t, name));
+			metrics_add(M_REMOVED, 1);
+			metrics_add(M_BYTES, e->stx.stx_blocks * 512);
+			if (log_on(LV_DEBUG))
+				log_msg(LV_DEBUG, "removed %s", entry_path(c, plen, ops[i].path));
+		} else if ( (errno = -ops[i].res) != ENOENT ) {
+			log_warn("unlink(%s)", entry_path(c, plen, ops[i].path));
+			metrics_add(M_ERRORS, 1);
+			c->incomplete = true;
+		}
+	}
+
+	for (i = 0; i < n && !halted(); i++)
+	{
+		/* reopened under a new number, or lost, while below */
+		if ( (dfd = l->ds.fd) == -1 )
+			break;
+
+		e = &ents[i];
+		if (e->skip || !S_ISDIR(e->stx.stx_mode))
+			continue;
+
+		if (e->stx.stx_dev_major != c->dev_major ||
+				e->stx.stx_dev_minor != c->dev_minor)
+			continue;
+
+		/* decided before descending, reading the directory updates atime */
+		old = !e->keep && is_old(c, &e->stx, true);
+
+		entry_path(c, plen, e->name);
+		if (can_skip(c, e->stx.stx_ino, &e->stx.stx_ctime))
+			goto skipped;
+
+		sfd = openat(dfd, e->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+		if (sfd == -1) {
+			if (errno != ENOENT) {
+				log_warn("open(%s)", c->path);
+				metrics_add(M_ERRORS, 1);
+				c->incomplete = true;
+			}
+			continue;
+		}
+
+		clean_at(c, sfd, e->stx.stx_ino, plen + 1 + strlen(e->name),
+				depth + 1);
+
+skipped:
+		if (!old)
+			continue;
+
+		entry_path(c, plen, e->name);
+		if (budget_take(1) || (dfd = l->ds.fd) == -1)
+			break;
+
+		res = unlinkat(dfd, e->name, AT_REMOVEDIR) ? -errno : 0;
+		TRACE2(clean__rmdir, c->path, res);
+
+		if (!res) {
+			dcache_invalidate(c->path);
+			state_forget(c->path);
+			metrics_add(M_REMOVED, 1);
+			metrics_add(M_BYTES, e->stx.stx_blocks * 512);
+			log_msg(LV_DEBUG, "removed %s/", c->path);
+		}
+		else if ( (errno = -res) != ENOTEMPTY && errno != EEXIST &&
+				errno != ENOENT && errno != EBUSY ) {
+			log_warn("rmdir(%s)", c->path);
+			metrics_add(M_ERRORS, 1);
+			c->incomplete = true;
+		}
+	}
+
+	c->path[plen] = '\0';
+	return;
+
+halt:
+	c->incomplete = true;
+	c->path[plen] = '\0';
+}
+
+/*
+ * Clean the directory open on dfd, with inode number ino and path
+ * c->path[0..plen]. Takes ownership of dfd.
+ */
+static void clean_at(cctx_t *c, int dfd, uint64_t ino, size_t plen,
+		int depth)
+{
+	struct statx_timestamp oldest = c->oldest;
+	bool has_oldest = c->has_oldest, incomplete = c->incomplete;
+	bool deep = depth >= CLEAN_MAXFDS;
+	size_t batch = deep ? CLEAN_DEEP_BATCH : CLEAN_BATCH;
+	clevel_t lv = { .ino = ino, .up = c->level }, *p;
+	centry_t *ents;
+	ioop_t *ops;
+	dsent_t ent;
+	size_t nlen, n = 0;
+	int rc = -1, ign, i;
+
+	/* this directory's own, merged into the parent's below */
+	c->has_oldest = false;
+	c->incomplete = false;
+
+	TRACE1(clean__dir__start, c->path);
+
+	if (ds_open(&lv.ds, dfd, deep ? CLEAN_DEEP_BUFSZ : CLEAN_BUFSZ)) {
+		log_warn("malloc");
+		c->incomplete = true;
+		goto merge;
+	}
+
+	/* keep at most CLEAN_MAXFDS levels open */
+	for (p = &lv, i = 0; p && i < CLEAN_MAXFDS; i++)
+		p = p->up;
+	if (p && p->ds.fd != -1)
+		park(p);
+	c->level = &lv;
+
+	ents = malloc(batch * sizeof(centry_t));
+	ops = malloc(batch * sizeof(ioop_t));
+	if (!ents || !ops) {
+		log_warn("malloc");
+		c->incomplete = true;
+		goto out;
+	}
+
+	while ( !halted() && (rc = ds_next(&lv.ds, &ent)) == 1 )
+	{
+		metrics_add(M_EXAMINED, 1);
+		nlen = strlen(ent.name);
+		if (plen + nlen + 2 > sizeof(c->path)) {
+			c->path[plen] = '\0';
+			log_warnx("path too long: %s/%s", c->path, ent.name);
+			c->incomplete = true;
+			continue;
+		}
+
+		ign = c->ignored ? c->ignored(entry_path(c, plen, ent.name))
+			: IGN_NONE;
+		if (ign == IGN_TREE)
+			continue;
+
+		ents[n].keep = ign == IGN_SELF || (c->subonly && depth == 0);
+		if (ents[n].keep && ent.type != DT_UNKNOWN && ent.type != DT_DIR)
+			continue;
+
+		memcpy(ents[n].name, ent.name, nlen + 1);
+		ents[n].type = ent.type;
+
+		if (++n == batch) {
+			clean_batch(c, &lv, plen, depth, ents, ops, n);
+			n = 0;
+			/* a parent that could not be reopened ends the walk */
+			if (lv.ds.fd == -1)
+				break;
+		}
+	}
+
+	if (n && lv.ds.fd != -1)
+		clean_batch(c, &lv, plen, depth, ents, ops, n);
+
+	c->path[plen] = '\0';
+
+	if (lv.ds.fd == -1) {
+		c->incomplete = true;
+		goto out;
+	}
+
+	if (rc == -1) {
+		log_warn("getdents(%s)", c->path);
+		metrics_add(M_ERRORS, 1);
+		c->incomplete = true;
+	}
+
+	record(c, lv.ds.fd);
+
+out:
+	free(ents);
+	free(ops);
+
+	c->level = lv.up;
+	if (lv.up && lv.up->ds.fd == -1 && lv.ds.fd != -1 &&
+			unpark(c, lv.up, lv.ds.fd)) {
+		metrics_add(M_ERRORS, 1);
+		c->incomplete = true;
+	}
+	ds_close(&lv.ds);
+
+merge:
+	TRACE2(clean__dir__done, c->path, c->incomplete);
+
+	if (has_oldest && (!c->has_oldest || ts_less(&oldest, &c->oldest)))
+		c->oldest = oldest;
+	c->has_oldest = c->has_oldest || has_oldest;
+	c->incomplete = c->incomplete || incomplete;
+}
+
+/*
+ * Remove everything below path older than age. With subonly, entries
+ * directly inside path are kept and only their contents are aged.
+ * ignored, if set, is asked about every entry before it is looked at.
+ *
+ * Returns:
+ * 1 with the time the first remaining entry becomes old in due, if due is
+ * set and there is such an entry, -1 on error, otherwise 0.
+ */
+int clean_path(const char *path, const struct timeval *age, int subonly,
+		clean_ign_fn ignored, struct timespec *due)
+{
+	struct stat sb;
+	cctx_t *c;
+	int fd;
+
+	if ( (fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1 ) {
+		if (errno == ENOENT)
+			return 0;
+		log_warn("open(%s)", path);
+		return -1;
+	}
+
+	if (fstat(fd, &sb) == -1 || strlen(path) >= PATH_MAX) {
+		log_warn("stat(%s)", path);
+		close(fd);
+		return -1;
+	}
+
+	if ( !(c = calloc(1, sizeof(cctx_t))) ) {
+		log_warn("calloc");
+		close(fd);
+		return -1;
+	}
+
+	c->unconditional = !age->tv_sec && !age->tv_usec;
+	c->age.tv_sec = age->tv_sec;
+	c->age.tv_nsec = age->tv_usec * 1000;
+	c->cutoff.tv_sec = now.tv_sec - age->tv_sec;
+	if (now.tv_nsec < (long)c->age.tv_nsec) {
+		c->cutoff.tv_sec--;
+		c->cutoff.tv_nsec = now.tv_nsec + 1000000000L - c->age.tv_nsec;
+	} else
+		c->cutoff.tv_nsec = now.tv_nsec - c->age.tv_nsec;
+	c->subonly = subonly;
+	c->dev_major = major(sb.st_dev);
+	c->dev_minor = minor(sb.st_dev);
+	c->ignored = ignored;
+	c->use_state = state_enabled() && !c->unconditional;
+	strcpy(c->path, path);
+
+	/* the whole tree may still be too young to look at */
+	if (can_skip(c, sb.st_ino, &(struct statx_timestamp){
+				.tv_sec = sb.st_ctim.tv_sec, .tv_nsec = sb.st_ctim.tv_nsec }))
+		close(fd);
+	else
+		clean_at(c, fd, sb.st_ino, strlen(path), 0);
+
+	/* try again soon for what was not reached */
+	if (due && budget_expired()) {
+		due->tv_sec = now.tv_sec;
+		due->tv_nsec = now.tv_nsec;
+		free(c);
+		return 1;
+	}
+
+	if (due && c->has_due) {
+		due->tv_sec = c->due.tv_sec;
+		due->tv_nsec = c->due.tv_nsec;
+		free(c);
+		return 1;
+	}
+
+	free(c);
+	return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef _CLEAN_H
+#define _CLEAN_H
+
+#include <time.h>
+#include <sys/time.h>
+
+/* answers of a clean_ign_fn */
+#define IGN_NONE	0
+#define IGN_SELF	1	/* keep the entry, but clean below it (X) */
+#define IGN_TREE	2	/* keep the entry and everything below it (x) */
+
+typedef int (*clean_ign_fn)(const char *path);
+
+void clean_init(void);
+void clean_stop(void);
+int clean_path(const char *path, const struct timeval *age, int subonly,
+		clean_ign_fn ignored, struct timespec *due);
+
+#endif
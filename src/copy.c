@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+
+#include "config.h"
+#include "copy.h"
+#include "dirstream.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * Recursive copy for C.
+ *
+ * File data is first reflinked with FICLONE, which shares the extents on
+ * btrfs, xfs and other CoW file systems and costs the same for any size.
+ * Where that is not possible copy_file_range() moves the data inside the
+ * kernel, and if even that fails, for instance across file systems on
+ * older kernels, a read/write loop picks up where it stopped. Owner,
+ * mode, extended attributes and timestamps follow the source.
+ *
+ * Nothing that exists is overwritten: a destination is only copied to if
+ * it is missing or an empty directory, and entries found below it while
+ * copying are left as they are.
+ *
+ * Directories are queued and copied by up to jobs threads, the calling
+ * one included, so independent subtrees proceed concurrently. A
+ * directory's own metadata is set once everything below it is done, as
+ * its mode may not allow writing into it.
+ */
+
+#define CP_BUFSZ	(128 * 1024)
+#define DS_BUFSZ	(8 * 1024)
+
+typedef struct cdir {
+	char *src;
+	char *dst;
+	struct stat st;		/* of src */
+	bool made;			/* dst was created here, not found empty */
+	unsigned pending;	/* itself and subdirectories not done yet */
+	struct cdir *parent;
+	struct cdir *next;	/* in the queue */
+} cdir_t;
+
+typedef struct cpool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	cdir_t *queue;
+	size_t remaining;	/* directories queued or being copied */
+	size_t created;
+	int rc;
+} cpool_t;
+
+static void fail(cpool_t *p)
+{
+	__atomic_store_n(&p->rc, -1, __ATOMIC_RELAXED);
+}
+
+static int copy_xattrs(int in, int out)
+{
+	char *list, *name, *val = NULL;
+	ssize_t len, vlen;
+	size_t vsize = 0;
+	int rc = 0;
+
+	if ((len = flistxattr(in, NULL, 0)) <= 0)
+		return len == -1 && errno != ENOTSUP ? -1 : 0;
+
+	if ( !(list = malloc(len)) )
+		return -1;
+
+	if ((len = flistxattr(in, list, len)) == -1) {
+		free(list);
+		return -1;
+	}
+
+	for (name = list; name < list + len; name += strlen(name) + 1)
+	{
+		if ((vlen = fgetxattr(in, name, NULL, 0)) == -1) {
+			rc = -1;
+			continue;
+		}
+
+		if ((size_t)vlen > vsize) {
+			free(val);
+			if ( !(val = malloc(vsize = vlen)) ) {
+				vsize = 0;
+				rc = -1;
+				break;
+			}
+		}
+
+		if ((vlen = fgetxattr(in, name, val, vlen)) == -1 ||
+				(fsetxattr(out, name, val, vlen, 0) == -1 &&
+				 errno != ENOTSUP))
+			rc = -1;
+	}
+
+	free(val);
+	free(list);
+	return rc;
+}
+
+/*
+ * Give out the owner, mode, extended attributes and times of in.
+ */
+static int copy_meta(int in, int out, const struct stat *st)
+{
+	struct timespec ts[2] = { st->st_atim, st->st_mtim };
+	int rc = 0;
+
+	if (fchown(out, st->st_uid, st->st_gid) == -1)
+		rc = -1;
+	/* after fchown(), which drops the set-id bits */
+	if (fchmod(out, st->st_mode & 07777) == -1)
+		rc = -1;
+	if (copy_xattrs(in, out))
+		rc = -1;
+	if (futimens(out, ts) == -1)
+		rc = -1;
+
+	return rc;
+}
+
+static int copy_data(int in, int out)
+{
+	char buf[CP_BUFSZ];
+	ssize_t n;
+
+	/* both offsets move along, so a fallback continues where this stops */
+	while ((n = copy_file_range(in, NULL, out, NULL, SSIZE_MAX, 0)) > 0)
+		;
+	if (n == 0)
+		return 0;
+	if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+			errno != EOPNOTSUPP && errno != EBADF)
+		return -1;
+
+	while ((n = read(in, buf, sizeof(buf))) > 0)
+		if (write_all(out, buf, n))
+			return -1;
+
+	return n;
+}
+
+static int copy_file(int sfd, const char *sname, int dfd, const char *dname,
+		const struct stat *st)
+{
+	int in, out, rc = 0;
+
+	if ((in = openat(sfd, sname, O_RDONLY|O_NOFOLLOW|O_CLOEXEC)) == -1)
+		return -1;
+
+	out = openat(dfd, dname, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,
+			0600);
+	if (out == -1) {
+		close(in);
+		return errno == EEXIST ? 1 : -1;
+	}
+
+#ifdef FICLONE
+	if (st->st_size && ioctl(out, FICLONE, in) == -1)
+#else
+	if (st->st_size)
+#endif
+		rc = copy_data(in, out);
+
+	if (rc) {
+		/* a partial copy would count as existing from now on */
+		int e = errno;
+		unlinkat(dfd, dname, 0);
+		errno = e;
+	} else
+		rc = copy_meta(in, out, st);
+
+	close(out);
+	close(in);
+	return rc;
+}
+
+/*
+ * Copy a non-directory. Returns 0 when created, 1 if dname already
+ * exists or -1 on error.
+ */
+static int copy_entry(int sfd, const char *sname, int dfd, const char *dname,
+		const struct stat *st)
+{
+	struct timespec ts[2] = { st->st_atim, st->st_mtim };
+	char target[PATH_MAX];
+	ssize_t len;
+	int rc = 0;
+
+	if (S_ISREG(st->st_mode))
+		return copy_file(sfd, sname, dfd, dname, st);
+
+	if (S_ISLNK(st->st_mode)) {
+		if ((len = readlinkat(sfd, sname, target, sizeof(target) - 1)) == -1)
+			return -1;
+		target[len] = '\0';
+		if (symlinkat(target, dfd, dname) == -1)
+			return errno == EEXIST ? 1 : -1;
+	} else {
+		if (mknodat(dfd, dname, st->st_mode & (S_IFMT|0600), st->st_rdev) == -1)
+			return errno == EEXIST ? 1 : -1;
+	}
+
+	if (fchownat(dfd, dname, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW) == -1)
+		rc = -1;
+	if (!S_ISLNK(st->st_mode) &&
+			fchmodat(dfd, dname, st->st_mode & 07777, 0) == -1)
+		rc = -1;
+	if (utimensat(dfd, dname, ts, AT_SYMLINK_NOFOLLOW) == -1)
+		rc = -1;
+
+	return rc;
+}
+
+static cdir_t *cdir_new(const char *src, const char *dst, const char *name,
+		const struct stat *st, bool made, cdir_t *parent)
+{
+	cdir_t *d;
+
+	if ( !(d = calloc(1, sizeof(cdir_t))) )
+		err(EXIT_FAILURE, "calloc");
+
+	if (name) {
+		if (asprintf(&d->src, "%s/%s", src, name) == -1 ||
+				asprintf(&d->dst, "%s/%s", dst, name) == -1)
+			err(EXIT_FAILURE, "asprintf");
+	} else if ( !(d->src = strdup(src)) || !(d->dst = strdup(dst)) )
+		err(EXIT_FAILURE, "strdup");
+
+	d->st = *st;
+	d->made = made;
+	d->pending = 1;
+	d->parent = parent;
+	if (parent)
+		__atomic_add_fetch(&parent->pending, 1, __ATOMIC_RELAXED);
+
+	return d;
+}
+
+static void push(cpool_t *p, cdir_t *d)
+{
+	pthread_mutex_lock(&p->lock);
+	d->next = p->queue;
+	p->queue = d;
+	p->remaining++;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void dir_meta(cpool_t *p, cdir_t *d)
+{
+	int in, out = -1;
+
+	if ((in = open(d->src, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1 ||
+			(out = open(d->dst, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1 ||
+			copy_meta(in, out, &d->st)) {
+		log_warn("copy(%s, %s)", d->src, d->dst);
+		fail(p);
+	}
+
+	if (out != -1)
+		close(out);
+	if (in != -1)
+		close(in);
+}
+
+/*
+ * Drop the reference d holds on itself, finishing it and any parent that
+ * was only waiting for it.
+ */
+static void dir_done(cpool_t *p, cdir_t *d)
+{
+	cdir_t *parent;
+
+	for (; d; d = parent)
+	{
+		if (__atomic_sub_fetch(&d->pending, 1, __ATOMIC_ACQ_REL))
+			return;
+
+		if (d->made)
+			dir_meta(p, d);
+
+		parent = d->parent;
+		free(d->src);
+		free(d->dst);
+		free(d);
+	}
+}
+
+static void copy_dir(cpool_t *p, cdir_t *d)
+{
+	struct stat st;
+	dstream_t ds;
+	dsent_t ent;
+	int sfd, dfd, rc;
+
+	if ((sfd = open(d->src, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1) {
+		log_warn("open(%s)", d->src);
+		fail(p);
+		return;
+	}
+
+	if ((dfd = open(d->dst, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1) {
+		log_warn("open(%s)", d->dst);
+		close(sfd);
+		fail(p);
+		return;
+	}
+
+	/* sfd is closed by ds_open() either way */
+	if (ds_open(&ds, sfd, DS_BUFSZ)) {
+		log_warn("malloc");
+		close(dfd);
+		fail(p);
+		return;
+	}
+
+	while ((rc = ds_next(&ds, &ent)) > 0)
+	{
+		if (fstatat(ds.fd, ent.name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			log_warn("stat(%s/%s)", d->src, ent.name);
+			fail(p);
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			if (mkdirat(dfd, ent.name, 0700) == -1) {
+				if (errno != EEXIST) {
+					log_warn("mkdir(%s/%s)", d->dst, ent.name);
+					fail(p);
+				}
+				continue;
+			}
+			__atomic_add_fetch(&p->created, 1, __ATOMIC_RELAXED);
+			push(p, cdir_new(d->src, d->dst, ent.name, &st, true, d));
+			continue;
+		}
+
+		if ((rc = copy_entry(ds.fd, ent.name, dfd, ent.name, &st)) == -1) {
+			log_warn("copy(%s/%s)", d->dst, ent.name);
+			fail(p);
+		} else if (!rc)
+			__atomic_add_fetch(&p->created, 1, __ATOMIC_RELAXED);
+	}
+
+	if (rc == -1) {
+		log_warn("getdents(%s)", d->src);
+		fail(p);
+	}
+
+	ds_close(&ds);
+	close(dfd);
+}
+
+static void *worker(void *arg)
+{
+	cpool_t *p = arg;
+	cdir_t *d;
+
+	pthread_mutex_lock(&p->lock);
+
+	while (p->remaining)
+	{
+		if (!p->queue) {
+			pthread_cond_wait(&p->cond, &p->lock);
+			continue;
+		}
+
+		d = p->queue;
+		p->queue = d->next;
+		pthread_mutex_unlock(&p->lock);
+
+		copy_dir(p, d);
+		dir_done(p, d);
+
+		pthread_mutex_lock(&p->lock);
+		/* what d queued was counted before this */
+		p->remaining--;
+		pthread_cond_broadcast(&p->cond);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static int is_empty(const char *dir)
+{
+	dstream_t ds;
+	dsent_t ent;
+	int fd, rc;
+
+	/* ds_open() closes fd if it fails */
+	if ((fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1 ||
+			ds_open(&ds, fd, 256))
+		return -1;
+
+	rc = ds_next(&ds, &ent);
+	ds_close(&ds);
+
+	return rc == -1 ? -1 : !rc;
+}
+
+/*
+ * Copy src to dst unless dst exists and is anything but an empty
+ * directory. The number of entries created is stored in created, errors
+ * are logged as they happen and make this return -1.
+ */
+int copy_tree(const char *src, const char *dst, unsigned jobs, size_t *created)
+{
+	struct stat st, dt;
+	pthread_t *threads;
+	unsigned i, started = 0;
+	bool made = true;
+	cpool_t p;
+	int rc;
+
+	*created = 0;
+
+	if (lstat(src, &st) == -1) {
+		log_warn("stat(%s)", src);
+		return -1;
+	}
+
+	if (lstat(dst, &dt) == 0) {
+		if (!S_ISDIR(st.st_mode) || !S_ISDIR(dt.st_mode))
+			return 0;
+		if ((rc = is_empty(dst)) <= 0) {
+			if (rc == -1)
+				log_warn("open(%s)", dst);
+			return rc;
+		}
+		made = false;
+	} else if (errno != ENOENT) {
+		log_warn("stat(%s)", dst);
+		return -1;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		if ((rc = copy_entry(AT_FDCWD, src, AT_FDCWD, dst, &st)) == -1) {
+			log_warn("copy(%s, %s)", src, dst);
+			return -1;
+		}
+		*created = !rc;
+		return 0;
+	}
+
+	if (made && mkdir(dst, 0700) == -1) {
+		log_warn("mkdir(%s)", dst);
+		return -1;
+	}
+
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.cond, NULL);
+	p.queue = NULL;
+	p.remaining = 0;
+	p.created = made;
+	p.rc = 0;
+
+	push(&p, cdir_new(src, dst, NULL, &st, made, NULL));
+
+	if (jobs > 1 && (threads = calloc(jobs - 1, sizeof(pthread_t)))) {
+		for (i = 0; i < jobs - 1; i++) {
+			if (pthread_create(&threads[i], NULL, worker, &p))
+				break;
+			started++;
+		}
+	} else
+		threads = NULL;
+
+	worker(&p);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&p.cond);
+	pthread_mutex_destroy(&p.lock);
+	free(threads);
+
+	*created = p.created;
+	return p.rc;
+}
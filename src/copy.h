@@ -0,0 +1,11 @@
+#ifndef _COPY_H
+#define _COPY_H
+
+#include <stddef.h>
+
+/* where C takes its source from when the argument is empty */
+#define FACTORY_DIR	"/usr/share/factory"
+
+int copy_tree(const char *src, const char *dst, unsigned jobs, size_t *created);
+
+#endif
@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include "daemon.h"
+#include "watch.h"
+#include "schedule.h"
+#include "clean.h"
+#include "log.h"
+
+/*
+ * --daemon: keep the rules loaded and clean each tree when it needs it.
+ *
+ * Every directory with an aged d, D or v rule is a tree with a due time,
+ * the moment its first entry becomes old, as reported by the last clean.
+ * A change inside a watched tree can only add young entries, so it moves
+ * the due time to no later than now plus the age instead of cleaning
+ * right away. Trees that could not be watched completely are also cleaned
+ * at least once per age. A change to a config directory, or SIGHUP,
+ * reloads the rules after a short delay that lets bursts of writes settle.
+ *
+ * Due trees sit in a min-heap, so a wakeup only looks at the trees that
+ * are actually due; a tree with nothing left to age out is not in it.
+ */
+
+#define RELOAD_DELAY_MS	500
+#define MIN_INTERVAL_MS	1000
+
+typedef struct dtree {
+	sched_ent_t ent;	/* first, the heap hands these back */
+	const rule_t *rule;
+	char *path;
+	size_t len;
+	bool watched;
+} dtree_t;
+
+static dtree_t **trees = NULL;
+static sched_t sched;
+static size_t ntrees = 0, trees_size = 0;
+static struct timespec now, reload_at;
+static bool reload_pending = false;
+static volatile sig_atomic_t stop = 0, hup = 0;
+static int wfd = -1;
+
+static void on_signal(int sig)
+{
+	if (sig == SIGHUP)
+		hup = 1;
+	else {
+		stop = 1;
+		clean_stop();
+	}
+}
+
+static bool ts_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static struct timespec ts_add(const struct timespec *a, time_t sec, long nsec)
+{
+	struct timespec t = { a->tv_sec + sec, a->tv_nsec + nsec };
+
+	if (t.tv_nsec >= 1000000000L) {
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000L;
+	}
+
+	return t;
+}
+
+/* now plus the age of t, but not sooner than MIN_INTERVAL_MS */
+static struct timespec next_due(const dtree_t *t)
+{
+	const struct timeval *age = &t->rule->age;
+
+	if (age->tv_sec * 1000 + age->tv_usec / 1000 < MIN_INTERVAL_MS)
+		return ts_add(&now, MIN_INTERVAL_MS / 1000,
+				(MIN_INTERVAL_MS % 1000) * 1000000L);
+
+	return ts_add(&now, age->tv_sec, age->tv_usec * 1000L);
+}
+
+void dm_init(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	if ( (wfd = watch_init()) == -1 )
+		log_write(LV_WARN, errno, "no fanotify or inotify, cleaning on timers only");
+}
+
+void dm_watch_config(const char *dir)
+{
+	if (wfd != -1 && watch_add(dir, WATCH_CONFIG) && errno != ENOENT)
+		log_warn("watch(%s)", dir);
+}
+
+/*
+ * Register the directory path, cleaned by r. It is first cleaned as soon
+ * as dm_run() starts.
+ */
+void dm_add(const rule_t *r, const char *path)
+{
+	dtree_t **tmp, *t;
+
+	if (ntrees == trees_size) {
+		trees_size = trees_size ? trees_size * 2 : 16;
+		if ( !(tmp = realloc(trees, trees_size * sizeof(dtree_t *))) )
+			err(EXIT_FAILURE, "realloc");
+		trees = tmp;
+	}
+
+	if ( !(t = calloc(1, sizeof(dtree_t))) || !(t->path = strdup(path)) )
+		err(EXIT_FAILURE, "calloc");
+	t->rule = r;
+	t->len = strlen(path);
+	t->watched = wfd != -1 && !watch_add(path, WATCH_TREE);
+	t->ent.pos = SCHED_NONE;
+	sched_set(&sched, &t->ent, &now);
+	trees[ntrees++] = t;
+}
+
+void dm_clear(void)
+{
+	sched_free(&sched);
+	for (size_t i = 0; i < ntrees; i++) {
+		free(trees[i]->path);
+		free(trees[i]);
+	}
+	ntrees = 0;
+
+	if (wfd != -1)
+		watch_reset();
+}
+
+static void on_change(const char *dir, unsigned flags)
+{
+	struct timespec due;
+	dtree_t *t;
+	size_t len;
+
+	if ((flags & (WATCH_CONFIG|WATCH_OVERFLOW)) && !reload_pending) {
+		reload_pending = true;
+		reload_at = ts_add(&now, 0, RELOAD_DELAY_MS * 1000000L);
+	}
+
+	if ( !(flags & (WATCH_TREE|WATCH_OVERFLOW)) )
+		return;
+
+	len = dir ? strlen(dir) : 0;
+
+	for (size_t i = 0; i < ntrees; i++)
+	{
+		t = trees[i];
+
+		/* events were lost, look at everything */
+		if (flags & WATCH_OVERFLOW) {
+			sched_set(&sched, &t->ent, &now);
+			continue;
+		}
+
+		if (t->len > len || memcmp(t->path, dir, t->len) ||
+				(len > t->len && dir[t->len] != '/'))
+			continue;
+
+		due = next_due(t);
+		if (t->ent.pos == SCHED_NONE || ts_before(&due, &t->ent.due))
+			sched_set(&sched, &t->ent, &due);
+	}
+}
+
+static void clean_due(dm_clean_fn clean)
+{
+	struct timespec due, poll_due, floor;
+	dtree_t *t;
+	int rc;
+
+	while ( (t = (dtree_t *)sched_first(&sched)) && !ts_before(&now, &t->ent.due) )
+	{
+		rc = clean(t->rule, t->path, &due);
+
+		/* nothing would tell us about new entries */
+		poll_due = next_due(t);
+		if (!t->watched && (rc != 1 || ts_before(&poll_due, &due))) {
+			due = poll_due;
+			rc = 1;
+		}
+
+		/* an entry on the verge of ageing out must not make us spin */
+		floor = ts_add(&now, MIN_INTERVAL_MS / 1000,
+				(MIN_INTERVAL_MS % 1000) * 1000000L);
+		if (ts_before(&due, &floor))
+			due = floor;
+
+		if (rc == 1)
+			sched_set(&sched, &t->ent, &due);
+		else
+			sched_remove(&sched, &t->ent);
+
+		clock_gettime(CLOCK_REALTIME, &now);
+	}
+}
+
+/* milliseconds until the next thing to do, -1 if nothing is scheduled */
+static int next_timeout(void)
+{
+	const sched_ent_t *e = sched_first(&sched);
+	struct timespec first;
+	long long ms;
+
+	if (e && (!reload_pending || ts_before(&e->due, &reload_at)))
+		first = e->due;
+	else if (reload_pending)
+		first = reload_at;
+	else
+		return -1;
+	if (!ts_before(&now, &first))
+		return 0;
+
+	ms = (long long)(first.tv_sec - now.tv_sec) * 1000 +
+		(first.tv_nsec - now.tv_nsec + 999999) / 1000000;
+
+	return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+/*
+ * Run until SIGTERM or SIGINT.
+ */
+void dm_run(dm_reload_fn reload, dm_clean_fn clean)
+{
+	struct pollfd pfd;
+	struct timespec ts;
+	sigset_t sigs, orig;
+	int rc, ms;
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGHUP);
+
+	while (!stop)
+	{
+		clock_gettime(CLOCK_REALTIME, &now);
+
+		if (hup) {
+			hup = 0;
+			reload_pending = true;
+			reload_at = now;
+		}
+
+		if (reload_pending && !ts_before(&now, &reload_at)) {
+			reload_pending = false;
+			dm_clear();
+			reload();
+			continue;
+		}
+
+		clean_due(clean);
+		/* nothing waits in the log while idle */
+		log_flush();
+
+		/*
+		 * A signal between looking at the flags and sleeping would go
+		 * unnoticed until the next wakeup, if there is one. Only let
+		 * them in while ppoll() waits.
+		 */
+		sigprocmask(SIG_BLOCK, &sigs, &orig);
+		if (stop || hup) {
+			sigprocmask(SIG_SETMASK, &orig, NULL);
+			continue;
+		}
+
+		pfd.fd = wfd;
+		pfd.events = POLLIN;
+
+		ms = next_timeout();
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000L;
+
+		rc = ppoll(&pfd, wfd == -1 ? 0 : 1, ms == -1 ? NULL : &ts, &orig);
+		if (rc == -1 && errno != EINTR)
+			err(EXIT_FAILURE, "ppoll");
+		sigprocmask(SIG_SETMASK, &orig, NULL);
+
+		if (rc > 0) {
+			clock_gettime(CLOCK_REALTIME, &now);
+			watch_read(on_change);
+		}
+	}
+}
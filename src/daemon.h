@@ -0,0 +1,20 @@
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <time.h>
+
+#include "rule.h"
+
+/* load the configs again and re-register what to watch */
+typedef void (*dm_reload_fn)(void);
+/* clean one tree, as clean_path() */
+typedef int (*dm_clean_fn)(const rule_t *r, const char *path,
+		struct timespec *due);
+
+void dm_init(void);
+void dm_watch_config(const char *dir);
+void dm_add(const rule_t *r, const char *path);
+void dm_clear(void);
+void dm_run(dm_reload_fn reload, dm_clean_fn clean);
+
+#endif
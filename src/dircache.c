@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dircache.h"
+
+/*
+ * Open-directory cache.
+ *
+ * Keeps O_PATH descriptors for the parent directories used most recently,
+ * so rules sharing a parent (the many /run/... entries in a typical
+ * config) resolve it once and then only look up their last component.
+ * Entries are pinned while in use and only unpinned entries are evicted,
+ * least recently used first.
+ */
+
+#define DCACHE_SIZE	32
+
+typedef struct dent {
+	char *dir;
+	size_t len;
+	int fd;
+	unsigned refs;
+	unsigned long stamp;
+	int dead;
+} dent_t;
+
+static dent_t dcache[DCACHE_SIZE];
+static unsigned long dclock = 0;
+static pthread_mutex_t dlock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Split path into the length of its parent directory and its last
+ * component, ignoring trailing slashes.
+ */
+static size_t split_parent(const char *path, const char **name)
+{
+	size_t len = strlen(path);
+
+	while (len > 1 && path[len-1] == '/')
+		len--;
+
+	while (len && path[len-1] != '/')
+		len--;
+
+	*name = path + len;
+
+	while (len > 1 && path[len-1] == '/')
+		len--;
+
+	return len;
+}
+
+static int lookup(const char *dir, size_t len)
+{
+	int i;
+
+	for (i = 0; i < DCACHE_SIZE; i++)
+		if (dcache[i].dir && !dcache[i].dead && dcache[i].len == len &&
+				!memcmp(dcache[i].dir, dir, len))
+			return i;
+
+	return -1;
+}
+
+static int victim(void)
+{
+	int i, ret = -1;
+
+	for (i = 0; i < DCACHE_SIZE; i++) {
+		if (!dcache[i].dir)
+			return i;
+		if (dcache[i].refs)
+			continue;
+		if (dcache[i].dead)
+			return i;
+		if (ret == -1 || dcache[i].stamp < dcache[ret].stamp)
+			ret = i;
+	}
+
+	return ret;
+}
+
+/*
+ * Resolve the parent directory of path, from the cache if possible.
+ * Returns 0 with ref filled in, or -1 with errno set.
+ */
+int dcache_get(const char *path, dref_t *ref)
+{
+	const char *name;
+	char *dir;
+	size_t len;
+	int i, fd;
+
+	len = split_parent(path, &name);
+
+	if (!len || !*name) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ref->name = name;
+
+	pthread_mutex_lock(&dlock);
+	if ( (i = lookup(path, len)) != -1 ) {
+		dcache[i].refs++;
+		dcache[i].stamp = ++dclock;
+		ref->fd = dcache[i].fd;
+		ref->slot = i;
+		pthread_mutex_unlock(&dlock);
+		return 0;
+	}
+	pthread_mutex_unlock(&dlock);
+
+	if ( !(dir = strndup(path, len)) )
+		return -1;
+
+	if ( (fd = open(dir, O_PATH|O_DIRECTORY|O_CLOEXEC)) == -1 ) {
+		free(dir);
+		return -1;
+	}
+
+	ref->fd = fd;
+	ref->slot = -1;
+
+	pthread_mutex_lock(&dlock);
+	/* another thread may have raced us here, then ours stays private */
+	if ( lookup(path, len) == -1 && (i = victim()) != -1 ) {
+		if (dcache[i].dir) {
+			close(dcache[i].fd);
+			free(dcache[i].dir);
+		}
+		dcache[i].dir = dir;
+		dcache[i].len = len;
+		dcache[i].fd = fd;
+		dcache[i].refs = 1;
+		dcache[i].stamp = ++dclock;
+		dcache[i].dead = 0;
+		ref->slot = i;
+		dir = NULL;
+	}
+	pthread_mutex_unlock(&dlock);
+
+	free(dir);
+	return 0;
+}
+
+void dcache_put(dref_t *ref)
+{
+	if (ref->slot == -1) {
+		if (ref->fd != -1)
+			close(ref->fd);
+	} else {
+		pthread_mutex_lock(&dlock);
+		if (!--dcache[ref->slot].refs && dcache[ref->slot].dead) {
+			close(dcache[ref->slot].fd);
+			free(dcache[ref->slot].dir);
+			dcache[ref->slot].dir = NULL;
+		}
+		pthread_mutex_unlock(&dlock);
+	}
+
+	ref->fd = -1;
+	ref->slot = -1;
+}
+
+/*
+ * Forget cached directories at or below path, e.g. after removing it.
+ * Pinned entries are only marked, and closed once their last user is done.
+ */
+void dcache_invalidate(const char *path)
+{
+	size_t len = strlen(path);
+	int i;
+
+	while (len > 1 && path[len-1] == '/')
+		len--;
+
+	pthread_mutex_lock(&dlock);
+	for (i = 0; i < DCACHE_SIZE; i++)
+	{
+		if (!dcache[i].dir || dcache[i].len < len)
+			continue;
+		if (memcmp(dcache[i].dir, path, len))
+			continue;
+		if (dcache[i].len > len && dcache[i].dir[len] != '/' && len > 1)
+			continue;
+
+		if (dcache[i].refs) {
+			dcache[i].dead = 1;
+			continue;
+		}
+
+		close(dcache[i].fd);
+		free(dcache[i].dir);
+		dcache[i].dir = NULL;
+	}
+	pthread_mutex_unlock(&dlock);
+}
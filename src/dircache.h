@@ -0,0 +1,18 @@
+#ifndef _DIRCACHE_H
+#define _DIRCACHE_H
+
+/*
+ * A pinned reference to the parent directory of a path. name is the last
+ * component of the path, to be used with the *at() family relative to fd.
+ */
+typedef struct dref {
+	int fd;
+	int slot;
+	const char *name;
+} dref_t;
+
+int dcache_get(const char *path, dref_t *ref);
+void dcache_put(dref_t *ref);
+void dcache_invalidate(const char *path);
+
+#endif
@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "dirstream.h"
+#include "metrics.h"
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/*
+ * Start reading the directory open on fd, which the stream now owns. On
+ * failure fd is closed, so callers never have to.
+ */
+int ds_open(dstream_t *ds, int fd, size_t size)
+{
+	ds->fd = fd;
+	ds->size = size;
+	ds->len = 0;
+	ds->pos = 0;
+
+	if ( !(ds->buf = malloc(size)) ) {
+		close(fd);
+		ds->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Fetch the next entry, skipping "." and "..". ent->name stays valid until
+ * the next call. Returns 1 for an entry, 0 at the end or -1 on error.
+ */
+int ds_next(dstream_t *ds, dsent_t *ent)
+{
+	struct linux_dirent64 *d;
+	long rc;
+
+	for (;;)
+	{
+		if (ds->pos >= ds->len) {
+			rc = syscall(SYS_getdents64, ds->fd, ds->buf, ds->size);
+			metrics_add(M_SYSCALLS, 1);
+			if (rc == -1)
+				return -1;
+			if (rc == 0)
+				return 0;
+			ds->len = rc;
+			ds->pos = 0;
+		}
+
+		d = (struct linux_dirent64 *)(ds->buf + ds->pos);
+		ds->pos += d->d_reclen;
+
+		if (d->d_name[0] == '.' && (!d->d_name[1] ||
+					(d->d_name[1] == '.' && !d->d_name[2])))
+			continue;
+
+		ent->name = d->d_name;
+		ent->ino = d->d_ino;
+		ent->type = d->d_type;
+		return 1;
+	}
+}
+
+void ds_close(dstream_t *ds)
+{
+	if (ds->fd != -1)
+		close(ds->fd);
+	free(ds->buf);
+	ds->fd = -1;
+	ds->buf = NULL;
+}
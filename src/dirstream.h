@@ -0,0 +1,30 @@
+#ifndef _DIRSTREAM_H
+#define _DIRSTREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Directory reader on top of getdents64(), filling a caller sized buffer
+ * per syscall rather than the small one readdir() uses.
+ */
+typedef struct dstream {
+	int fd;
+	char *buf;
+	size_t size;
+	size_t len;
+	size_t pos;
+} dstream_t;
+
+typedef struct dsent {
+	const char *name;
+	uint64_t ino;
+	unsigned char type;
+} dsent_t;
+
+/* takes ownership of fd, which is closed right away if this fails */
+int ds_open(dstream_t *ds, int fd, size_t size);
+int ds_next(dstream_t *ds, dsent_t *ent);
+void ds_close(dstream_t *ds);
+
+#endif
@@ -0,0 +1,248 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "executor.h"
+#include "log.h"
+
+/*
+ * Rule executor.
+ *
+ * Rules run in config order. With more than one job, rules are split
+ * into groups that cannot touch each other's paths, and the groups are
+ * run concurrently, each in config order on one worker thread.
+ *
+ * Two rules depend on each other when the key of one is the same as, or
+ * a directory prefix of, the key of the other. The key is the path, or
+ * for a glob the literal directory in front of its first wildcard, as
+ * that is all a glob can match below; so R /x/a* and d /x/ab, or
+ * z /x/?.conf and f /x/a.conf, end up in one group. Sorting the keys
+ * puts every directory right in front of everything below it, so the
+ * groups are the trees of the forest this order spans.
+ *
+ * x/X rules do not take part; they are run first, serially, so every
+ * ignore is registered before any cleanup starts.
+ */
+
+typedef struct node {
+	const rule_t *rule;
+	char *key;
+	size_t idx;
+	size_t group;
+} node_t;
+
+typedef struct group {
+	node_t **nodes;		/* in config order */
+	size_t n;
+} group_t;
+
+typedef struct pool {
+	pthread_mutex_t lock;
+	group_t *groups;
+	size_t ngroups;
+	size_t next;
+	exec_fn fn;
+} pool_t;
+
+/*
+ * strcmp() but with '/' sorting before every other character, so a
+ * directory is directly followed by everything below it.
+ */
+static int path_cmp(const char *a, const char *b)
+{
+	unsigned char ca, cb;
+
+	for (; *a && *a == *b; a++, b++)
+		;
+
+	ca = *a == '/' ? 1 : (unsigned char)*a;
+	cb = *b == '/' ? 1 : (unsigned char)*b;
+
+	return ca - cb;
+}
+
+static int node_cmp(const void *a, const void *b)
+{
+	const node_t *na = *(node_t * const *)a, *nb = *(node_t * const *)b;
+	int r;
+
+	if ( (r = path_cmp(na->key, nb->key)) )
+		return r;
+
+	return na->idx < nb->idx ? -1 : na->idx > nb->idx;
+}
+
+static bool is_parent(const char *dir, const char *path)
+{
+	size_t len = strlen(dir);
+
+	if (strncmp(dir, path, len))
+		return false;
+
+	return !path[len] || path[len] == '/' || (len && dir[len-1] == '/');
+}
+
+/*
+ * The part of path no glob can vary: all of it, or the directory in
+ * front of the first component holding a wildcard.
+ */
+static char *rule_key(const char *path)
+{
+	size_t len = strcspn(path, "*?[");
+	char *key;
+
+	if (path[len])
+		while (len && path[len] != '/')
+			len--;
+
+	/* keep the slash of the root */
+	if (!len && path[0] == '/')
+		len = 1;
+
+	if ( !(key = malloc(len + 1)) )
+		err(1, "malloc");
+	memcpy(key, path, len);
+	key[len] = '\0';
+
+	return key;
+}
+
+static void run_group(const group_t *g, exec_fn fn)
+{
+	for (size_t i = 0; i < g->n; i++)
+		fn(g->nodes[i]->rule);
+}
+
+static void *worker(void *arg)
+{
+	pool_t *p = arg;
+	size_t i;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&p->lock);
+		i = p->next++;
+		pthread_mutex_unlock(&p->lock);
+
+		if (i >= p->ngroups)
+			break;
+
+		run_group(&p->groups[i], p->fn);
+	}
+
+	return NULL;
+}
+
+static void run_pool(group_t *groups, size_t ngroups, unsigned jobs,
+		exec_fn fn)
+{
+	pthread_t *threads;
+	pool_t p;
+	unsigned i, started = 0;
+
+	if (jobs > ngroups)
+		jobs = ngroups;
+
+	if ( !(threads = calloc(jobs, sizeof(pthread_t))) )
+		err(1, "calloc");
+
+	pthread_mutex_init(&p.lock, NULL);
+	p.groups = groups;
+	p.ngroups = ngroups;
+	p.next = 0;
+	p.fn = fn;
+
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&threads[i], NULL, worker, &p)) {
+			log_warn("pthread_create");
+			break;
+		}
+		started++;
+	}
+
+	if (!started)
+		worker(&p);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&p.lock);
+	free(threads);
+}
+
+void exec_run(rule_t **rules, size_t count, unsigned jobs, exec_fn fn)
+{
+	node_t *nodes, **sorted, **stack, **byidx;
+	group_t *groups;
+	size_t i, n = 0, depth = 0, ngroups = 0;
+
+	for (i = 0; i < count; i++)
+		if (rules[i]->act == IGN || rules[i]->act == IGNR)
+			fn(rules[i]);
+
+	if (jobs <= 1) {
+		for (i = 0; i < count; i++)
+			if (rules[i]->act != IGN && rules[i]->act != IGNR)
+				fn(rules[i]);
+		return;
+	}
+
+	if ( !(nodes = calloc(count ? count : 1, sizeof(node_t))) ||
+			!(sorted = calloc(count ? count : 1, sizeof(node_t *))) ||
+			!(stack = calloc(count ? count : 1, sizeof(node_t *))) )
+		err(1, "calloc");
+
+	for (i = 0; i < count; i++) {
+		if (rules[i]->act == IGN || rules[i]->act == IGNR)
+			continue;
+		nodes[n].rule = rules[i];
+		nodes[n].key = rule_key(rules[i]->xpath);
+		nodes[n].idx = n;
+		sorted[n] = &nodes[n];
+		n++;
+	}
+
+	qsort(sorted, n, sizeof(node_t *), node_cmp);
+
+	/* a rule joins the group of the closest key above it, if any */
+	for (i = 0; i < n; i++)
+	{
+		while (depth && !is_parent(stack[depth-1]->key, sorted[i]->key))
+			depth--;
+
+		sorted[i]->group = depth ? stack[depth-1]->group : ngroups++;
+		stack[depth++] = sorted[i];
+	}
+
+	/* lay the groups out one after the other, each in config order */
+	if ( !(groups = calloc(ngroups ? ngroups : 1, sizeof(group_t))) ||
+			!(byidx = calloc(n ? n : 1, sizeof(node_t *))) )
+		err(1, "calloc");
+
+	for (i = 0; i < n; i++)
+		groups[nodes[i].group].n++;
+	for (i = 0, depth = 0; i < ngroups; i++) {
+		groups[i].nodes = byidx + depth;
+		depth += groups[i].n;
+		groups[i].n = 0;
+	}
+	for (i = 0; i < n; i++) {
+		group_t *g = &groups[nodes[i].group];
+		g->nodes[g->n++] = &nodes[i];
+	}
+
+	if (ngroups)
+		run_pool(groups, ngroups, jobs, fn);
+
+	for (i = 0; i < n; i++)
+		free(nodes[i].key);
+	free(byidx);
+	free(groups);
+	free(stack);
+	free(sorted);
+	free(nodes);
+}
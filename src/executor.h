@@ -0,0 +1,10 @@
+#ifndef _EXECUTOR_H
+#define _EXECUTOR_H
+
+#include "rule.h"
+
+typedef void (*exec_fn)(const rule_t *r);
+
+void exec_run(rule_t **rules, size_t count, unsigned jobs, exec_fn fn);
+
+#endif
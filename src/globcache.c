@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "globcache.h"
+#include "dirstream.h"
+#include "metrics.h"
+#include "trace.h"
+
+/*
+ * Path expansion on top of a shared directory listing cache.
+ *
+ * The first wildcard component below a directory reads the whole
+ * directory once and keeps its names and d_types, keyed by the device and
+ * inode of the directory; every later pattern under the same directory is
+ * matched against that listing with fnmatch() instead of rescanning it.
+ * A listing is dropped when the run creates or removes something at or
+ * below it (gc_invalidate()), and is not trusted once the directory mtime
+ * has moved on.
+ *
+ * As with glob(3) without flags, a leading '.' is only matched
+ * explicitly, a literal pattern matches only if the path exists and
+ * symbolic links to directories are followed for inner components.
+ */
+
+#define GC_BUCKETS	64
+#define GC_BUFSZ	(64 * 1024)
+
+typedef struct gdir {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	char *path;
+	size_t plen;
+	size_t n;
+	size_t *off;		/* name i is blob + off[i] */
+	unsigned char *type;
+	char *blob;
+	unsigned refs;
+	bool dead;
+	struct gdir *next;
+} gdir_t;
+
+typedef struct gres {
+	char **v;
+	size_t n;
+	size_t size;
+	size_t skip;	/* of the "./" put in front of relative patterns */
+} gres_t;
+
+static gdir_t *buckets[GC_BUCKETS];
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void gdir_free(gdir_t *d)
+{
+	free(d->path);
+	free(d->off);
+	free(d->type);
+	free(d->blob);
+	free(d);
+}
+
+static void gdir_put(gdir_t *d)
+{
+	pthread_mutex_lock(&gc_lock);
+	if (!--d->refs && d->dead)
+		gdir_free(d);
+	pthread_mutex_unlock(&gc_lock);
+}
+
+static gdir_t *gdir_read(int fd, const char *path)
+{
+	size_t bsize = 0, blen = 0, nsize = 0, len;
+	dstream_t ds;
+	dsent_t ent;
+	gdir_t *d;
+	void *p;
+	int rc;
+
+	if ( !(d = calloc(1, sizeof(gdir_t))) || !(d->path = strdup(path)) ) {
+		free(d);
+		close(fd);
+		return NULL;
+	}
+	d->plen = strlen(path);
+
+	if (ds_open(&ds, fd, GC_BUFSZ)) {
+		gdir_free(d);
+		return NULL;
+	}
+
+	while ( (rc = ds_next(&ds, &ent)) == 1 )
+	{
+		len = strlen(ent.name) + 1;
+
+		if (blen + len > bsize) {
+			bsize = bsize * 2 + len + 4096;
+			if ( !(p = realloc(d->blob, bsize)) )
+				goto fail;
+			d->blob = p;
+		}
+
+		if (d->n == nsize) {
+			nsize = nsize ? nsize * 2 : 64;
+			if ( !(p = realloc(d->off, nsize * sizeof(size_t))) )
+				goto fail;
+			d->off = p;
+			if ( !(p = realloc(d->type, nsize)) )
+				goto fail;
+			d->type = p;
+		}
+
+		memcpy(d->blob + blen, ent.name, len);
+		d->off[d->n] = blen;
+		d->type[d->n] = ent.type;
+		d->n++;
+		blen += len;
+	}
+
+	if (rc == -1)
+		goto fail;
+
+	ds_close(&ds);
+	return d;
+
+fail:
+	ds_close(&ds);
+	gdir_free(d);
+	return NULL;
+}
+
+/* the listing of path, read now or earlier during this run */
+static gdir_t *gdir_get(const char *path)
+{
+	gdir_t *d, *nd, **pp;
+	struct stat sb;
+	size_t h;
+	int fd;
+
+	if ( (fd = open(*path ? path : "/",
+					O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1 )
+		return NULL;
+
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	h = (sb.st_dev ^ sb.st_ino * 2654435761u) % GC_BUCKETS;
+
+	pthread_mutex_lock(&gc_lock);
+	for (pp = &buckets[h]; (d = *pp); pp = &d->next)
+	{
+		if (d->dev != sb.st_dev || d->ino != sb.st_ino)
+			continue;
+
+		if (d->mtime.tv_sec == sb.st_mtim.tv_sec &&
+				d->mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+			d->refs++;
+			pthread_mutex_unlock(&gc_lock);
+			close(fd);
+			return d;
+		}
+
+		/* changed behind our back */
+		*pp = d->next;
+		if (d->refs)
+			d->dead = true;
+		else
+			gdir_free(d);
+		break;
+	}
+	pthread_mutex_unlock(&gc_lock);
+
+	if ( !(nd = gdir_read(fd, path)) )
+		return NULL;
+
+	nd->dev = sb.st_dev;
+	nd->ino = sb.st_ino;
+	nd->mtime = sb.st_mtim;
+	nd->refs = 1;
+
+	pthread_mutex_lock(&gc_lock);
+	nd->next = buckets[h];
+	buckets[h] = nd;
+	pthread_mutex_unlock(&gc_lock);
+
+	return nd;
+}
+
+static bool has_magic(const char *s, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		if (s[i] == '*' || s[i] == '?' || s[i] == '[')
+			return true;
+
+	return false;
+}
+
+static void gres_add(gres_t *r, const char *path)
+{
+	char **v;
+
+	if (r->n == r->size) {
+		r->size = r->size ? r->size * 2 : 8;
+		if ( !(v = realloc(r->v, r->size * sizeof(char *))) )
+			err(EXIT_FAILURE, "realloc");
+		r->v = v;
+	}
+
+	if ( !(r->v[r->n] = strdup(path + r->skip)) )
+		err(EXIT_FAILURE, "strdup");
+	r->n++;
+}
+
+/*
+ * Match rest against what is below buf[0..blen], one component per call.
+ */
+static void gc_walk(char *buf, size_t blen, const char *rest, gres_t *r)
+{
+	char comp[PATH_MAX];
+	const char *next, *name;
+	struct stat sb;
+	gdir_t *d;
+	size_t len, nlen, i;
+
+	while (*rest == '/')
+		rest++;
+
+	len = strcspn(rest, "/");
+	next = rest + len;
+	while (*next == '/')
+		next++;
+
+	if (blen + 1 + len >= PATH_MAX)
+		return;
+
+	if (!has_magic(rest, len)) {
+		buf[blen] = '/';
+		memcpy(buf + blen + 1, rest, len);
+		buf[blen + 1 + len] = '\0';
+
+		if (*next)
+			gc_walk(buf, blen + 1 + len, next, r);
+		else if (!lstat(buf, &sb))
+			gres_add(r, buf);
+		buf[blen] = '\0';
+		return;
+	}
+
+	memcpy(comp, rest, len);
+	comp[len] = '\0';
+
+	if ( !(d = gdir_get(buf)) )
+		return;
+
+	for (i = 0; i < d->n; i++)
+	{
+		name = d->blob + d->off[i];
+
+		if (fnmatch(comp, name, FNM_PERIOD))
+			continue;
+		if ( (nlen = strlen(name)) + blen + 1 >= PATH_MAX )
+			continue;
+
+		buf[blen] = '/';
+		memcpy(buf + blen + 1, name, nlen + 1);
+
+		if (!*next)
+			gres_add(r, buf);
+		else if (d->type[i] == DT_DIR || ((d->type[i] == DT_UNKNOWN ||
+						d->type[i] == DT_LNK) && !stat(buf, &sb) &&
+					S_ISDIR(sb.st_mode)))
+			gc_walk(buf, blen + 1 + nlen, next, r);
+	}
+	buf[blen] = '\0';
+
+	gdir_put(d);
+}
+
+/*
+ * Expand pattern into a malloc()ed array of paths, to be
+ * released with gc_free().
+ *
+ * Returns:
+ * 0 if anything matched, otherwise -1.
+ */
+int gc_glob(const char *pattern, char ***matches, size_t *count)
+{
+	char buf[PATH_MAX];
+	gres_t r = { NULL, 0, 0, 0 };
+	mphase_t ph;
+
+	*matches = NULL;
+	*count = 0;
+
+	if (!pattern || !*pattern)
+		return -1;
+
+	if (*pattern == '/')
+		buf[0] = '\0';
+	else
+		strcpy(buf, ".");
+	r.skip = *pattern == '/' ? 0 : 2;
+
+	TRACE1(glob__start, pattern);
+	metrics_begin(&ph);
+	gc_walk(buf, strlen(buf), pattern, &r);
+	metrics_end(P_GLOB, &ph);
+	TRACE2(glob__done, pattern, r.n);
+	metrics_add(M_EXAMINED, r.n);
+
+	*matches = r.v;
+	*count = r.n;
+
+	return r.n ? 0 : -1;
+}
+
+void gc_free(char **matches, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		free(matches[i]);
+	free(matches);
+}
+
+/* is a a parent of b, or b itself? */
+static bool is_within(const char *a, size_t alen, const char *b, size_t blen)
+{
+	return alen <= blen && !memcmp(a, b, alen) &&
+		(alen == blen || b[alen] == '/' || !alen);
+}
+
+/*
+ * Something at path was created or removed: drop the listings of its
+ * parents and of anything below it.
+ */
+void gc_invalidate(const char *path)
+{
+	size_t len = strlen(path), i;
+	gdir_t *d, **pp;
+
+	while (len > 1 && path[len-1] == '/')
+		len--;
+
+	pthread_mutex_lock(&gc_lock);
+	for (i = 0; i < GC_BUCKETS; i++)
+		for (pp = &buckets[i]; (d = *pp); )
+		{
+			if (!is_within(d->path, d->plen, path, len) &&
+					!is_within(path, len, d->path, d->plen)) {
+				pp = &d->next;
+				continue;
+			}
+
+			*pp = d->next;
+			if (d->refs)
+				d->dead = true;
+			else
+				gdir_free(d);
+		}
+	pthread_mutex_unlock(&gc_lock);
+}
@@ -0,0 +1,10 @@
+#ifndef _GLOBCACHE_H
+#define _GLOBCACHE_H
+
+#include <stddef.h>
+
+int gc_glob(const char *pattern, char ***matches, size_t *count);
+void gc_free(char **matches, size_t count);
+void gc_invalidate(const char *path);
+
+#endif
@@ -0,0 +1,234 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/types.h>
+
+#include "idcache.h"
+#include "arena.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * Name to id cache for users and groups.
+ *
+ * The first lookup loads every entry of the passwd or group file below
+ * root in one pass. Names not found there fall back to NSS (getpwnam(),
+ * getgrnam()) once, and the answer, including a negative one, is kept
+ * for the rest of the run, or until idcache_reset().
+ */
+
+typedef struct ident {
+	const char *name;
+	unsigned id;
+	bool found;
+} ident_t;
+
+typedef struct idtab {
+	const char *file;
+	ident_t *ents;
+	size_t size;
+	size_t used;
+	bool loaded;
+	unsigned long hits;
+	unsigned long misses;
+} idtab_t;
+
+static const char *idroot = "";
+static idtab_t users = { "/etc/passwd", NULL, 0, 0, false, 0, 0 };
+static idtab_t groups = { "/etc/group", NULL, 0, 0, false, 0, 0 };
+
+void idcache_init(const char *root)
+{
+	idroot = root ? root : "";
+}
+
+static void forget(idtab_t *t)
+{
+	free(t->ents);
+	t->ents = NULL;
+	t->size = t->used = 0;
+	t->loaded = false;
+}
+
+/*
+ * Drop every answer, found or not, so the next lookup reads passwd and
+ * group again. Names stay in the arena until exit.
+ */
+void idcache_reset(void)
+{
+	forget(&users);
+	forget(&groups);
+}
+
+static size_t hash(const char *str)
+{
+	size_t h = 2166136261u;
+
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619u;
+
+	return h;
+}
+
+static ident_t *lookup(idtab_t *t, const char *name)
+{
+	size_t i;
+
+	if (!t->size)
+		return NULL;
+
+	for (i = hash(name) & (t->size - 1); t->ents[i].name;
+			i = (i + 1) & (t->size - 1))
+		if (!strcmp(t->ents[i].name, name))
+			return &t->ents[i];
+
+	return NULL;
+}
+
+static void insert(idtab_t *t, const char *name, unsigned id, bool found)
+{
+	ident_t *old = t->ents;
+	size_t i, oldsize = t->size;
+
+	if ( (t->used + 1) * 2 > t->size ) {
+		t->size = t->size ? t->size * 2 : 256;
+		if ( !(t->ents = calloc(t->size, sizeof(ident_t))) )
+			err(1, "calloc");
+		t->used = 0;
+		for (i = 0; i < oldsize; i++)
+			if (old[i].name)
+				insert(t, old[i].name, old[i].id, old[i].found);
+		free(old);
+	}
+
+	/* first entry in the file wins, like getpwnam() */
+	if (lookup(t, name))
+		return;
+
+	for (i = hash(name) & (t->size - 1); t->ents[i].name;
+			i = (i + 1) & (t->size - 1))
+		;
+
+	t->ents[i].name = name;
+	t->ents[i].id = id;
+	t->ents[i].found = found;
+	t->used++;
+}
+
+/*
+ * Both passwd and group carry the id in the third field.
+ */
+static void load(idtab_t *t)
+{
+	char path[PATH_MAX], *line = NULL, *name, *pw, *idt, *end;
+	size_t ign = 0;
+	unsigned long id;
+	FILE *fp;
+
+	t->loaded = true;
+
+	if ( !pathcpy(path, sizeof(path), idroot, t->file) )
+		return;
+
+	if ( !(fp = fopen(path, "r")) ) {
+		if (errno != ENOENT)
+			log_warn("fopen(%s%s)", idroot, t->file);
+		return;
+	}
+
+	while (getline(&line, &ign, fp) != -1)
+	{
+		name = line;
+		if (*name == '+' || *name == '-' || *name == '#')
+			continue;
+		if ( !(pw = strchr(name, ':')) )
+			continue;
+		*pw++ = '\0';
+		if ( !(idt = strchr(pw, ':')) )
+			continue;
+		idt++;
+
+		errno = 0;
+		id = strtoul(idt, &end, 10);
+		if (errno || end == idt || *end != ':' || !*name)
+			continue;
+
+		insert(t, arena_strdup(name), id, true);
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+static int resolve(idtab_t *t, const char *name, unsigned *id)
+{
+	ident_t *ent;
+	struct passwd *pw;
+	struct group *gr;
+
+	if (!t->loaded)
+		load(t);
+
+	if ( (ent = lookup(t, name)) ) {
+		t->hits++;
+		if (!ent->found)
+			return -1;
+		*id = ent->id;
+		return 0;
+	}
+
+	t->misses++;
+
+	pw = NULL;
+	gr = NULL;
+
+	if (t == &users && (pw = getpwnam(name)))
+		*id = pw->pw_uid;
+	else if (t == &groups && (gr = getgrnam(name)))
+		*id = gr->gr_gid;
+
+	if (!pw && !gr) {
+		insert(t, arena_strdup(name), 0, false);
+		return -1;
+	}
+
+	insert(t, arena_strdup(name), *id, true);
+	return 0;
+}
+
+int idcache_uid(const char *name, uid_t *uid)
+{
+	unsigned id;
+
+	if (resolve(&users, name, &id))
+		return -1;
+
+	*uid = id;
+	return 0;
+}
+
+int idcache_gid(const char *name, gid_t *gid)
+{
+	unsigned id;
+
+	if (resolve(&groups, name, &id))
+		return -1;
+
+	*gid = id;
+	return 0;
+}
+
+void idcache_stats(FILE *fp)
+{
+	fprintf(fp, "idcache: users %lu hits %lu misses, "
+			"groups %lu hits %lu misses\n",
+			users.hits, users.misses, groups.hits, groups.misses);
+}
@@ -0,0 +1,13 @@
+#ifndef _IDCACHE_H
+#define _IDCACHE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+void idcache_init(const char *root);
+void idcache_reset(void);
+int idcache_uid(const char *name, uid_t *uid);
+int idcache_gid(const char *name, gid_t *gid);
+void idcache_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <err.h>
+#include <fnmatch.h>
+
+#include "ignore.h"
+#include "arena.h"
+#include "util.h"
+
+/*
+ * Ignore index for x and X rules.
+ *
+ * Literal paths are interned into a prefix trie, one node per component,
+ * with the children of every node kept in a single hash table keyed by
+ * (parent, name). A path with wildcards is split at its first globbed
+ * component: the literal part becomes trie nodes and the rest is kept as
+ * an fnmatch() pattern on the deepest literal node. A lookup walks the
+ * trie one component at a time, so checking an entry costs O(depth)
+ * hash probes plus the patterns hanging off the nodes on its way.
+ */
+
+typedef struct ipat {
+	const char *pat;
+	int kind;
+	struct ipat *next;
+} ipat_t;
+
+typedef struct inode {
+	const struct inode *parent;
+	const char *name;
+	size_t len;
+	size_t hash;
+	int kind;
+	ipat_t *pats;
+	struct inode *hnext;
+} inode_t;
+
+static inode_t top;
+static inode_t **tab = NULL;
+static size_t tab_size = 0, tab_used = 0;
+static bool any = false;
+
+static size_t node_hash(const inode_t *parent, const char *name, size_t len)
+{
+	size_t h = 2166136261u ^ (size_t)(uintptr_t)parent;
+
+	while (len--)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+
+	return h;
+}
+
+static inode_t *node_find(const inode_t *parent, const char *name, size_t len)
+{
+	size_t h;
+	inode_t *n;
+
+	if (!tab_size)
+		return NULL;
+
+	h = node_hash(parent, name, len);
+	for (n = tab[h & (tab_size - 1)]; n; n = n->hnext)
+		if (n->hash == h && n->parent == parent && n->len == len &&
+				!memcmp(n->name, name, len))
+			return n;
+
+	return NULL;
+}
+
+static void tab_grow(void)
+{
+	size_t size = tab_size ? tab_size * 2 : 64;
+	inode_t **nt, *n, *next;
+
+	if ( !(nt = calloc(size, sizeof(inode_t *))) )
+		err(1, "calloc");
+
+	for (size_t i = 0; i < tab_size; i++)
+		for (n = tab[i]; n; n = next) {
+			next = n->hnext;
+			n->hnext = nt[n->hash & (size - 1)];
+			nt[n->hash & (size - 1)] = n;
+		}
+
+	free(tab);
+	tab = nt;
+	tab_size = size;
+}
+
+static inode_t *node_get(inode_t *parent, const char *name, size_t len)
+{
+	inode_t *n;
+
+	if ( (n = node_find(parent, name, len)) )
+		return n;
+
+	if (tab_used >= tab_size / 2)
+		tab_grow();
+
+	n = arena_alloc(sizeof(inode_t));
+	memset(n, 0, sizeof(inode_t));
+	n->parent = parent;
+	n->name = arena_strndup(name, len);
+	n->len = len;
+	n->hash = node_hash(parent, name, len);
+	n->hnext = tab[n->hash & (tab_size - 1)];
+	tab[n->hash & (tab_size - 1)] = n;
+	tab_used++;
+
+	return n;
+}
+
+static bool has_glob(const char *s, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		if (s[i] == '*' || s[i] == '?' || s[i] == '[')
+			return true;
+
+	return false;
+}
+
+void ign_add(const char *path, int kind)
+{
+	inode_t *n = &top;
+	ipat_t *p;
+	size_t len;
+
+	if (!path || !*path)
+		return;
+
+	any = true;
+
+	while (*path)
+	{
+		while (*path == '/')
+			path++;
+		if (!*path)
+			break;
+
+		len = strcspn(path, "/");
+
+		if (has_glob(path, len)) {
+			p = arena_alloc(sizeof(ipat_t));
+			p->pat = arena_strdup(path);
+			p->kind = kind;
+			p->next = n->pats;
+			n->pats = p;
+			return;
+		}
+
+		n = node_get(n, path, len);
+		path += len;
+	}
+
+	n->kind = MAX(n->kind, kind);
+}
+
+/* as glob(3) would have: '/' and a leading '.' are only matched literally */
+static int pats_check(const inode_t *n, const char *rest)
+{
+	int ret = IGN_NONE;
+
+	for (const ipat_t *p = n->pats; p; p = p->next)
+	{
+		if (p->kind <= ret)
+			continue;
+		if (!fnmatch(p->pat, rest, FNM_PATHNAME|FNM_PERIOD|
+					(p->kind == IGN_TREE ? FNM_LEADING_DIR : 0)))
+			ret = p->kind;
+	}
+
+	return ret;
+}
+
+/*
+ * Returns IGN_TREE if path or one of its parents is ignored with x, else
+ * IGN_SELF if path itself is ignored with X, else IGN_NONE.
+ */
+int ign_check(const char *path)
+{
+	const inode_t *n = &top;
+	int ret = IGN_NONE;
+	size_t len;
+
+	if (!any || !path)
+		return IGN_NONE;
+
+	while (n)
+	{
+		while (*path == '/')
+			path++;
+
+		if (n->pats && *path)
+			ret = MAX(ret, pats_check(n, path));
+
+		if (!*path) {
+			ret = MAX(ret, n->kind);
+			break;
+		}
+
+		if (n->kind == IGN_TREE || ret == IGN_TREE)
+			return IGN_TREE;
+
+		len = strcspn(path, "/");
+		n = node_find(n, path, len);
+		path += len;
+	}
+
+	return ret;
+}
+
+/*
+ * Drop every entry. The nodes themselves live in the arena.
+ */
+void ign_reset(void)
+{
+	free(tab);
+	tab = NULL;
+	tab_size = tab_used = 0;
+	memset(&top, 0, sizeof(top));
+	any = false;
+}
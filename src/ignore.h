@@ -0,0 +1,14 @@
+#ifndef _IGNORE_H
+#define _IGNORE_H
+
+#include "clean.h"
+
+/*
+ * Run wide index of x and X paths. kind is IGN_TREE for x, IGN_SELF for X.
+ * Entries are added before any cleanup starts; lookups are read only.
+ */
+void ign_add(const char *path, int kind);
+int ign_check(const char *path);
+void ign_reset(void);
+
+#endif
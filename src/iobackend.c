@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+
+#include "config.h"
+#include "iobackend.h"
+#include "metrics.h"
+#include "log.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+#endif
+
+/*
+ * Metadata syscall backends.
+ *
+ * The sync backend issues the calls of a batch one after another. The
+ * uring backend queues the whole batch on an io_uring owned by the
+ * calling thread and waits for all of it in as few io_uring_enter() calls
+ * as possible, so the kernel works on many lookups at once. Chained ops
+ * are linked with IOSQE_IO_HARDLINK, which keeps their order without
+ * cancelling the rest of the chain when one fails (mkdirat() of something
+ * that already exists, say). A batch larger than the ring is queued in
+ * parts that each end before a chain that would not fit; only a chain
+ * longer than the ring is split, its rest waiting for the part before.
+ * The ring is talked to directly through the syscalls; no liburing is
+ * needed.
+ */
+
+static int use_uring = 0;
+static int no_statx = 0;
+
+static int sync_statx(ioop_t *o)
+{
+	struct stat sb;
+
+	if (!no_statx) {
+		if (!statx(o->dfd, o->path, o->flags, o->mode, o->stx))
+			return 0;
+		if (errno != ENOSYS)
+			return -1;
+		no_statx = 1;
+	}
+
+	if (fstatat(o->dfd, o->path, &sb, o->flags & AT_SYMLINK_NOFOLLOW) == -1)
+		return -1;
+
+	memset(o->stx, 0, sizeof(struct statx));
+	o->stx->stx_mask = STATX_BASIC_STATS;
+	o->stx->stx_mode = sb.st_mode;
+	o->stx->stx_ino = sb.st_ino;
+	o->stx->stx_nlink = sb.st_nlink;
+	o->stx->stx_uid = sb.st_uid;
+	o->stx->stx_gid = sb.st_gid;
+	o->stx->stx_size = sb.st_size;
+	o->stx->stx_dev_major = major(sb.st_dev);
+	o->stx->stx_dev_minor = minor(sb.st_dev);
+	o->stx->stx_atime.tv_sec = sb.st_atim.tv_sec;
+	o->stx->stx_atime.tv_nsec = sb.st_atim.tv_nsec;
+	o->stx->stx_mtime.tv_sec = sb.st_mtim.tv_sec;
+	o->stx->stx_mtime.tv_nsec = sb.st_mtim.tv_nsec;
+	o->stx->stx_ctime.tv_sec = sb.st_ctim.tv_sec;
+	o->stx->stx_ctime.tv_nsec = sb.st_ctim.tv_nsec;
+
+	return 0;
+}
+
+static void sync_one(ioop_t *o)
+{
+	int r = -1;
+
+	metrics_add(M_SYSCALLS, 1);
+
+	switch (o->op)
+	{
+		case IO_STATX:	r = sync_statx(o); break;
+		case IO_UNLINK:	r = unlinkat(o->dfd, o->path, o->flags); break;
+		case IO_MKDIR:	r = mkdirat(o->dfd, o->path, o->mode); break;
+		case IO_OPEN:	r = openat(o->dfd, o->path, o->flags, o->mode); break;
+		case IO_CLOSE:	r = close(o->dfd); break;
+		default:		errno = EINVAL; break;
+	}
+
+	o->res = r == -1 ? -errno : r;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#define RING_ENTRIES	64
+
+typedef struct ring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+} ring_t;
+
+static const unsigned char uring_ops[] = {
+	[IO_STATX]	= IORING_OP_STATX,
+	[IO_UNLINK]	= IORING_OP_UNLINKAT,
+	[IO_MKDIR]	= IORING_OP_MKDIRAT,
+	[IO_OPEN]	= IORING_OP_OPENAT,
+	[IO_CLOSE]	= IORING_OP_CLOSE
+};
+
+static pthread_key_t ring_key;
+
+static void ring_free(void *p)
+{
+	ring_t *r = p;
+
+	if (!r)
+		return;
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_len);
+	if (r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_len);
+	close(r->fd);
+	free(r);
+}
+
+static ring_t *ring_new(void)
+{
+	struct io_uring_params p;
+	ring_t *r;
+	void *m;
+
+	if ( !(r = calloc(1, sizeof(ring_t))) )
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	if ( (r->fd = syscall(SYS_io_uring_setup, RING_ENTRIES, &p)) == -1 ) {
+		free(r);
+		return NULL;
+	}
+
+	r->entries = p.sq_entries;
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+
+	if ( (m = mmap(NULL, r->sq_len, PROT_READ|PROT_WRITE,
+					MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING))
+			== MAP_FAILED )
+		goto fail;
+	r->sq_ptr = m;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ptr = r->sq_ptr;
+	else if ( (m = mmap(NULL, r->cq_len, PROT_READ|PROT_WRITE,
+					MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING))
+			== MAP_FAILED )
+		goto fail;
+	else
+		r->cq_ptr = m;
+
+	if ( (m = mmap(NULL, r->sqes_len, PROT_READ|PROT_WRITE,
+					MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES))
+			== MAP_FAILED )
+		goto fail;
+	r->sqes = m;
+
+	r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+	return r;
+
+fail:
+	ring_free(r);
+	return NULL;
+}
+
+/* can the kernel do every op we hand it? */
+static int ring_probe(const ring_t *r)
+{
+	struct io_uring_probe *p;
+	size_t i, n = 256;
+	int ok = 0;
+
+	if ( !(p = calloc(1, sizeof(*p) + n * sizeof(struct io_uring_probe_op))) )
+		return 0;
+
+	if (syscall(SYS_io_uring_register, r->fd, IORING_REGISTER_PROBE, p, n)
+			!= -1) {
+		ok = 1;
+		for (i = 0; i < sizeof(uring_ops); i++)
+			if (uring_ops[i] > p->last_op ||
+					!(p->ops[uring_ops[i]].flags & IO_URING_OP_SUPPORTED))
+				ok = 0;
+	}
+
+	free(p);
+	return ok;
+}
+
+static void ring_fill(struct io_uring_sqe *sqe, const ioop_t *o)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = uring_ops[o->op];
+	sqe->fd = o->dfd;
+
+	switch (o->op)
+	{
+		case IO_STATX:
+			sqe->addr = (uintptr_t)o->path;
+			sqe->len = o->mode;
+			sqe->off = (uintptr_t)o->stx;
+			sqe->statx_flags = o->flags;
+			break;
+		case IO_UNLINK:
+			sqe->addr = (uintptr_t)o->path;
+			sqe->unlink_flags = o->flags;
+			break;
+		case IO_MKDIR:
+			sqe->addr = (uintptr_t)o->path;
+			sqe->len = o->mode;
+			break;
+		case IO_OPEN:
+			sqe->addr = (uintptr_t)o->path;
+			sqe->len = o->mode;
+			sqe->open_flags = o->flags;
+			break;
+	}
+}
+
+/* run n <= r->entries ops */
+static void ring_run(ring_t *r, ioop_t *ops, size_t n)
+{
+	unsigned tail, head, idx;
+	size_t i, submitted = 0, done = 0;
+	struct io_uring_cqe *cqe;
+	long ret;
+
+	tail = *r->sq_tail;
+	for (i = 0; i < n; i++, tail++)
+	{
+		idx = tail & *r->sq_mask;
+		ring_fill(&r->sqes[idx], &ops[i]);
+		r->sqes[idx].user_data = i;
+		if (i + 1 < n && ops[i + 1].chain)
+			r->sqes[idx].flags |= IOSQE_IO_HARDLINK;
+		r->sq_array[idx] = idx;
+	}
+	__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+	while (done < n)
+	{
+		ret = syscall(SYS_io_uring_enter, r->fd, n - submitted, n - done,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		metrics_add(M_SYSCALLS, 1);
+		if (ret == -1) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			err(EXIT_FAILURE, "io_uring_enter");
+		}
+		submitted += ret;
+
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			cqe = &r->cqes[head & *r->cq_mask];
+			ops[cqe->user_data].res = cqe->res;
+			done++;
+			head++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+static ring_t *ring_get(void)
+{
+	ring_t *r;
+
+	if ( (r = pthread_getspecific(ring_key)) )
+		return r;
+
+	if ( (r = ring_new()) )
+		pthread_setspecific(ring_key, r);
+
+	return r;
+}
+
+static int uring_init(void)
+{
+	ring_t *r;
+
+	if (pthread_key_create(&ring_key, ring_free))
+		return -1;
+
+	if ( !(r = ring_new()) ) {
+		log_warn("io_uring_setup");
+		return -1;
+	}
+
+	if (!ring_probe(r)) {
+		log_msg(LV_WARN, "io_uring lacks statx, unlinkat, mkdirat, openat or close");
+		ring_free(r);
+		return -1;
+	}
+
+	pthread_setspecific(ring_key, r);
+	return 0;
+}
+#endif
+
+/*
+ * Select the backend by name, "sync" or "uring". If io_uring is not
+ * usable the sync backend is used instead.
+ *
+ * Returns:
+ * -1 for an unknown name, otherwise 0.
+ */
+int io_init(const char *name)
+{
+	if (!name || !strcmp(name, "sync")) {
+		use_uring = 0;
+		return 0;
+	}
+
+	if (strcmp(name, "uring"))
+		return -1;
+
+#ifdef HAVE_LINUX_IO_URING_H
+	use_uring = !uring_init();
+#else
+	log_msg(LV_WARN, "built without io_uring support");
+#endif
+	if (!use_uring)
+		log_msg(LV_WARN, "falling back to the sync backend");
+
+	return 0;
+}
+
+const char *io_backend(void)
+{
+	return use_uring ? "uring" : "sync";
+}
+
+void io_submit(ioop_t *ops, size_t n)
+{
+	size_t i;
+
+#ifdef HAVE_LINUX_IO_URING_H
+	ring_t *r;
+	size_t m, k;
+
+	if (use_uring && (r = ring_get())) {
+		for (i = 0; i < n; i += m)
+		{
+			m = n - i < r->entries ? n - i : r->entries;
+
+			/* end the part before the head of a chain that goes on past it */
+			for (k = m; k && i + k < n && ops[i + k].chain; k--)
+				;
+			if (k)
+				m = k;
+
+			ring_run(r, ops + i, m);
+		}
+		return;
+	}
+#endif
+
+	for (i = 0; i < n; i++)
+		sync_one(&ops[i]);
+}
@@ -0,0 +1,35 @@
+#ifndef _IOBACKEND_H
+#define _IOBACKEND_H
+
+#include <sys/stat.h>
+
+/*
+ * Batched metadata operations. A batch is handed over in one go and every
+ * op in it has completed when io_submit() returns, with res set to what
+ * the syscall would have returned, or -errno.
+ */
+
+enum {
+	IO_STATX,	/* statx(dfd, path, flags, mode as mask, stx) */
+	IO_UNLINK,	/* unlinkat(dfd, path, flags) */
+	IO_MKDIR,	/* mkdirat(dfd, path, mode) */
+	IO_OPEN,	/* openat(dfd, path, flags, mode) */
+	IO_CLOSE	/* close(dfd) */
+};
+
+typedef struct ioop {
+	unsigned char op;
+	unsigned char chain;	/* start only once the previous op completed */
+	int dfd;
+	const char *path;
+	int flags;
+	unsigned mode;
+	struct statx *stx;
+	int res;
+} ioop_t;
+
+int io_init(const char *name);
+const char *io_backend(void);
+void io_submit(ioop_t *ops, size_t n);
+
+#endif
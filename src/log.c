@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include "config.h"
+#include "log.h"
+#include "util.h"
+
+/*
+ * Leveled logging for everything but fatal errors, which still go
+ * through err() as they end the run.
+ *
+ * Messages below the level are dropped by log_on() before any argument
+ * is formatted. The rest are collected in one buffer that is written
+ * when full, by log_flush() and at exit, so a run that reports many
+ * entries costs a write per buffer rather than one per message. Errors
+ * and warnings are written right away with whatever came before them,
+ * so they are never stuck behind the message of a later err(). To
+ * syslog every message is handed over as it comes, syslog buffers on
+ * its own; /dev/kmsg takes one record per write, so for it the buffer
+ * is written line by line.
+ */
+
+#define LOG_BUF		8192
+#define LOG_LINE	1024
+
+int log_level = LV_NOTICE;
+
+static int sink = SINK_STDERR;
+static int kmsg_fd = -1;
+static char buf[LOG_BUF];
+static size_t used = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static const char *const level_names[] = {
+	"error", "warning", "notice", "info", "debug"
+};
+
+static const int level_prio[] = {
+	LOG_ERR, LOG_WARNING, LOG_NOTICE, LOG_INFO, LOG_DEBUG
+};
+
+int log_parse_level(const char *name)
+{
+	for (int i = 0; i <= LV_DEBUG; i++)
+		if (!strcmp(name, level_names[i]))
+			return i;
+
+	return -1;
+}
+
+int log_parse_sink(const char *name)
+{
+	if (!strcmp(name, "stderr"))
+		return SINK_STDERR;
+	if (!strcmp(name, "syslog"))
+		return SINK_SYSLOG;
+	if (!strcmp(name, "kmsg"))
+		return SINK_KMSG;
+
+	return -1;
+}
+
+/* with lock held */
+static void flush_locked(void)
+{
+	char *p, *nl;
+
+	if (sink != SINK_KMSG) {
+		write_all(STDERR_FILENO, buf, used);
+	} else {
+		for (p = buf; p < buf + used; p = nl + 1) {
+			nl = memchr(p, '\n', buf + used - p);
+			if (write(kmsg_fd, p, nl - p + 1) == -1)
+				break;
+		}
+	}
+
+	used = 0;
+}
+
+void log_flush(void)
+{
+	pthread_mutex_lock(&lock);
+	if (used)
+		flush_locked();
+	pthread_mutex_unlock(&lock);
+}
+
+void log_open(int to)
+{
+	/* what was logged so far was formatted for stderr */
+	log_flush();
+
+	if (to == SINK_SYSLOG) {
+		openlog(program_invocation_short_name, LOG_PID, LOG_DAEMON);
+	} else if (to == SINK_KMSG) {
+		/* during early boot, before there is a syslog daemon */
+		if ((kmsg_fd = open("/dev/kmsg", O_WRONLY|O_CLOEXEC)) == -1) {
+			warn("open(/dev/kmsg)");
+			to = SINK_STDERR;
+		}
+	}
+
+	sink = to;
+}
+
+static void flush_at_exit(void)
+{
+	atexit(log_flush);
+}
+
+void log_write(int level, int errnum, const char *fmt, ...)
+{
+	char line[LOG_LINE];
+	va_list ap;
+	int len = 0;
+
+	if (sink == SINK_KMSG)
+		len = snprintf(line, sizeof(line), "<%d>",
+				LOG_DAEMON | level_prio[level]);
+	if (sink != SINK_SYSLOG)
+		len += snprintf(line + len, sizeof(line) - len, "%s: ",
+				program_invocation_short_name);
+
+	va_start(ap, fmt);
+	len += vsnprintf(line + len, sizeof(line) - len, fmt, ap);
+	va_end(ap);
+
+	if (errnum && len < (int)sizeof(line))
+		len += snprintf(line + len, sizeof(line) - len, ": %s",
+				strerror(errnum));
+
+	/* truncated messages still end their line */
+	if (len > (int)sizeof(line) - 2)
+		len = sizeof(line) - 2;
+
+	if (sink == SINK_SYSLOG) {
+		syslog(level_prio[level], "%.*s", len, line);
+		return;
+	}
+
+	line[len++] = '\n';
+
+	pthread_once(&once, flush_at_exit);
+	pthread_mutex_lock(&lock);
+	if (used + len > sizeof(buf))
+		flush_locked();
+	memcpy(buf + used, line, len);
+	used += len;
+	if (level <= LV_WARN)
+		flush_locked();
+	pthread_mutex_unlock(&lock);
+}
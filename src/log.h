@@ -0,0 +1,37 @@
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <errno.h>
+
+/* levels, most important first */
+#define LV_ERROR	0
+#define LV_WARN		1
+#define LV_NOTICE	2	/* the summary of a run, with --stats */
+#define LV_INFO		3	/* one line per rule, and the summary */
+#define LV_DEBUG	4	/* one line per entry */
+
+/* where messages go */
+#define SINK_STDERR	0
+#define SINK_SYSLOG	1
+#define SINK_KMSG	2
+
+extern int log_level;
+
+/* a single compare, cheap enough to guard logging in any loop */
+#define log_on(l)	((l) <= log_level)
+
+#define log_msg(l, ...) \
+	do { if (log_on(l)) log_write((l), 0, __VA_ARGS__); } while (0)
+
+/* the equivalents of warn() and warnx(), logged as errors */
+#define log_warn(...)	log_write(LV_ERROR, errno, __VA_ARGS__)
+#define log_warnx(...)	log_write(LV_ERROR, 0, __VA_ARGS__)
+
+int log_parse_level(const char *name);
+int log_parse_sink(const char *name);
+void log_open(int sink);
+void log_write(int level, int errnum, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+void log_flush(void);
+
+#endif
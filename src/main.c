@@ -14,62 +14,62 @@
 #include <grp.h>
 #include <unistd.h>
 #include <sys/utsname.h>
-#include <glob.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <time.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <signal.h>
 
 #include "config.h"
 #include "util.h"
-
-#define	CREAT_FILE	0x00
-#define TRUNC_FILE	0x01
-#define WRITE_ARG	0x02
-#define MKDIR		0x04
-#define MKDIR_RMF	0x05
-#define CREATE_SVOL	0x06
-#define CREATE_PIPE	0x08
-#define CREATE_SYM	0x0A
-#define	CREATE_CHAR	0x0C
-#define CREATE_BLK	0x0E
-#define	COPY		0x10
-#define	IGN			0x12
-#define	IGNR		0x13
-#define	RM			0x14
-#define	RMRF		0x15
-#define	CHMOD		0x16
-#define	CHMODR		0x17
-#define	CHATTR		0x18
-#define	CHATTRR		0x19
-#define	ACL			0x20
-#define	ACLR		0x21
-
-#define MAX_TYPE	0x21
+#include "rule.h"
+#include "cache.h"
+#include "arena.h"
+#include "spec.h"
+#include "idcache.h"
+#include "ruletab.h"
+#include "executor.h"
+#include "dircache.h"
+#include "clean.h"
+#include "ignore.h"
+#include "rmtree.h"
+#include "iobackend.h"
+#include "globcache.h"
+#include "daemon.h"
+#include "state.h"
+#include "budget.h"
+#include "metrics.h"
+#include "trace.h"
+#include "copy.h"
+#include "writer.h"
+#include "log.h"
 
 #define MAX(a, b) (a < b ? b : a)
 
 #define DEF_FILE (S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)
 #define DEF_FOLD (DEF_FILE|S_IXUSR|S_IXGRP|S_IXOTH)
 
+/* a failure of the rule being executed, counted in its metrics */
+#define rwarn(...)	do { metrics_add(M_ERRORS, 1); log_warn(__VA_ARGS__); } while (0)
+#define rwarnx(...)	do { metrics_add(M_ERRORS, 1); log_warnx(__VA_ARGS__); } while (0)
+
+#define STATS_TEXT	1
+#define STATS_JSON	2
+
 static int do_create=0, do_clean=0, do_remove=0, do_boot=0;
-static int do_help=0, do_version=0; 
+static int do_help=0, do_version=0, do_stats=0, do_daemon=0;
 static char *prefix = NULL, *exclude = NULL, *root = NULL;
+static char *compile_cache = NULL;
+static int log_sink = SINK_STDERR;
+static char *state_file = NULL;
+static char *metrics_file = NULL;
+static int do_state = 0;
+static unsigned jobs = 1;
 static char **config_files = NULL;
 static int num_config_files = 0;
-static char *hostname = NULL;
-static char *machineid = NULL;
-static char *kernelrel = NULL;
-static char *bootid = NULL;
-
-typedef struct ignent {
-	char path[PATH_MAX];
-	bool contents;
-} ignent_t;
-
-static ignent_t *ignores = NULL;
-int ignores_size = 0;
 
 static void show_version()
 {
@@ -91,6 +91,32 @@ static void show_help()
 	"      --prefix=PATH          only apply rules with a matching path\n"
 	"      --exclude-prefix=PATH  ignores rules with paths that match\n"
 	"      --root=ROOT            all paths including config will be prefixed\n"
+	"  -j, --jobs=N               run up to N independent rules at once\n"
+	"      --backend=NAME         issue metadata syscalls via \"sync\" calls\n"
+	"                             or batched on \"uring\" (io_uring)\n"
+	"      --stats[=FORMAT]       print statistics when done, \"text\" for\n"
+	"                             lookups or \"json\" for run metrics\n"
+	"      --metrics-textfile=PATH\n"
+	"                             write run metrics to PATH for the\n"
+	"                             node_exporter textfile collector\n"
+	"      --compile-cache=PATH   load rules from PATH if it is up to date,\n"
+	"                             otherwise compile the configs into it\n"
+	"      --daemon               keep running, clean when entries age and\n"
+	"                             reload when the configs change\n"
+	"      --ioprio=CLASS         run at I/O priority \"idle\" or \"be:N\"\n"
+	"      --nice=N               run at nice value N\n"
+	"      --max-ops-per-sec=N    limit cleaning and r, R and D removal to N\n"
+	"                             operations a second\n"
+	"      --max-runtime=AGE      stop cleaning and r, R and D removal after\n"
+	"                             AGE, as in the Age field\n"
+	"      --state[=PATH]         remember what cleaning found to skip trees\n"
+	"                             with nothing old, and to resume after an\n"
+	"                             interruption (default " STATE_DIR "/clean)\n"
+	"  -q, --quiet                only log errors\n"
+	"  -v, --verbose              also log each rule, twice for each entry\n"
+	"      --log-level=LEVEL      log \"error\", \"warning\", \"notice\" (the\n"
+	"                             default), \"info\" or \"debug\" and above\n"
+	"      --log-target=TARGET    log to \"stderr\", \"syslog\" or \"kmsg\"\n"
 	"\n"
 	);
 
@@ -146,14 +172,14 @@ static uid_t vet_uid(const char **t, int *defuid)
 	if (isnumber(*t))
 		return atol(*t);
 
-	struct passwd *pw;
+	uid_t uid;
 
-	if ( (pw = getpwnam(*t)) == NULL) {
-		warn("getpwnam");
+	if (idcache_uid(*t, &uid)) {
+		log_warnx("unknown user: %s", *t);
 		return -1;
 	}
 
-	return pw->pw_uid;
+	return uid;
 }
 
 /*
@@ -171,104 +197,16 @@ static gid_t vet_gid(const char **t, int *defgid)
 	if (isnumber(*t))
 		return atol(*t);
 
-	struct group *gr;
+	gid_t gid;
 
-	if ( (gr = getgrnam(*t)) == NULL) {
-		warn("getgrnam");
+	if (idcache_gid(*t, &gid)) {
+		log_warnx("unknown group: %s", *t);
 		return -1;
 	}
 
-	return gr->gr_gid;
-}
-
-
-static const char *getbootid()
-{
-	if (bootid)
-		return bootid;
-
-	FILE *fp = NULL;
-	size_t ign = 0;
-
-	if ( (fp = fopen("/proc/sys/kernel/random/boot_id", "r")) == NULL ) {
-		warn("fopen");
-		return NULL;
-	}
-
-	if ( getline(&bootid, &ign, fp) < 36 ) {
-		if (bootid) {
-			free(bootid);
-			bootid = NULL;
-		}
-		warnx("getline");
-	}
-	bootid = trim(bootid);
-	fclose(fp);
-	return bootid;
-}
-
-
-static const char *getkernelrelease()
-{
-	if (kernelrel)
-		return kernelrel;
-
-	struct utsname *un;
-
-	if ( !(un = calloc(1, sizeof(struct utsname))) ) {
-		warn("calloc");
-		return NULL;
-	}
-
-	if ( uname(un) ) {
-		warn("uname");
-	} else {
-		kernelrel = strdup(un->release);
-	}
-
-	free(un);
-	return kernelrel;
-}
-
-static const char *gethost()
-{
-	if (hostname)
-		return hostname;
-
-	hostname = calloc(1, HOST_NAME_MAX + 1);
-	if (gethostname(hostname, HOST_NAME_MAX)) {
-		warn("gethostname");
-		free(hostname);
-		hostname = NULL;
-	}
-
-	return hostname;
+	return gid;
 }
 
-static const char *getmachineid()
-{
-	if (machineid)
-		return machineid;
-
-	FILE *fp = NULL;
-	size_t ign = 0;
-
-	if ( !(fp = fopen("/etc/machine-id", "r")) ) {
-		warn("getmachineid");
-		return NULL;
-	}
-
-	if ( getline(&machineid, &ign, fp) < 32 ) {
-		if (machineid) {
-			free(machineid);
-			machineid = NULL;
-		}
-		warnx("getline");
-	}
-	machineid = trim(machineid);
-	fclose(fp);
-	return machineid;
-}
 
 // FIXME implement '~'
 
@@ -297,7 +235,7 @@ static int vet_mode(const char **t, int *mask, int *defmode)
 
 	if (!isnumber(mod)) {
 		errno = EINVAL;
-		warn("vet_mode(%s)",mod);
+		log_warn("vet_mode(%s)",mod);
 		return -1;
 	}
 
@@ -305,85 +243,6 @@ static int vet_mode(const char **t, int *mask, int *defmode)
 	return strtol(mod, NULL, 8);
 }
 
-#define LEN 1024
-static char *expand_path(char *path)
-{
-	if (!path)
-		return NULL;
-
-	char *buf = calloc(1, LEN+1);
-	char *ptr = path;
-	const char *cpy;
-	char tmp;
-	int spos = 0, dpos = 0;
-
-	if (!buf)
-		err(1, "malloc");
-
-	while((tmp = ptr[spos]) && dpos < LEN)
-	{
-		if (tmp != '%') {
-			buf[dpos++] = ptr[spos++];
-			continue;
-		}
-
-		tmp = ptr[++spos];
-		if (dpos >= LEN || !tmp) 
-			continue;
-
-		switch (tmp)
-		{
-			case '%':
-				buf[dpos++] = ptr[spos];
-				break;
-			case 'b':
-				if ( !(cpy = getbootid()) ) continue;
-				strncpy(buf+dpos, cpy, LEN-dpos);
-				dpos += strlen(cpy);
-				break;
-			case 'm':
-				if ( !(cpy = getmachineid()) ) continue;
-				strncpy(buf+dpos, cpy, LEN-dpos);
-				dpos += strlen(cpy);
-				break;
-			case 'H':
-				if ( !(cpy = gethost()) ) continue;
-				strncpy(buf+dpos, cpy, LEN-dpos);
-				dpos += strlen(cpy);
-				break;
-			case 'v':
-				if ( !(cpy = getkernelrelease()) ) continue;
-				strncpy(buf+dpos, cpy, LEN-dpos);
-				dpos += strlen(cpy);
-				break;
-			default:
-				warnx("Unhandled expansion %c\n", tmp);
-				break;
-		}
-
-		spos++;
-	}
-
-	free(path);
-	return buf;
-}
-#undef LEN
-
-/*
- * %m - Machine ID (machine-id(5))
- * %b - Boot ID
- * %H - Host name
- * %v - Kernel release (uname -r)
- * %% - %
- */
-static char *vet_path(char *path)
-{
-	if (strchr(path, '%'))
-		path = expand_path(path);
-
-	return path;
-}
-
 /*
  * If an integer is given without a unit, s is assumed.
  *
@@ -394,15 +253,14 @@ static char *vet_path(char *path)
  * but not the files and directories immediately inside it.
  */
 
-static struct timeval *vet_age(const char **t, int *subonly)
+static int vet_age(const char **t, struct timeval *tv, int *subonly)
 {
 	if (!t || !*t || **t == '-')
-		return NULL;
+		return -1;
 
-	u_int64_t val;
-	int read, ret;
-	char *tmp = NULL; 
+	u_int64_t val, ret;
 	const char *src = *t;
+	char *tmp = NULL;
 
 	if (*src == '~') {
 		*subonly = 1;
@@ -410,81 +268,36 @@ static struct timeval *vet_age(const char **t, int *subonly)
 	} else 
 		*subonly = 0;
 
-	read = sscanf(src, "%u%ms", &ret, &tmp);
-
-	if (read == 0 || read > 2) {
-		if (tmp) free(tmp);
-		warnx("invalid age: %s\n", *t);
-		return NULL;
+	if (!isdigit((unsigned char)*src)) {
+		log_warnx("invalid age: %s", *t);
+		return -1;
 	}
 
-	if ( !tmp || !*tmp )
-		val = (u_int64_t)ret * 1000000;
+	ret = strtoull(src, &tmp, 10);
+
+	if ( !*tmp )
+		val = ret * 1000000;
 	else if ( !strcmp(tmp, "ms") )
-		val = (u_int64_t)ret * 1000;
+		val = ret * 1000;
 	else if ( !strcmp(tmp, "s") )
-		val = (u_int64_t)ret * 1000000;
+		val = ret * 1000000;
 	else if ( !strcmp(tmp, "m") || !strcmp(tmp, "min") )
-		val = (u_int64_t)ret * 1000000 * 60;
+		val = ret * 1000000 * 60;
 	else if ( !strcmp(tmp, "h") )
-		val = (u_int64_t)ret * 1000000 * 60 * 60;
+		val = ret * 1000000 * 60 * 60;
 	else if ( !strcmp(tmp, "d") ) {
-		val = (u_int64_t)ret * 1000000 * 60 * 60 * 24;
+		val = ret * 1000000 * 60 * 60 * 24;
 	} else if ( !strcmp(tmp, "w") )
-		val = (u_int64_t)ret * 1000000 * 60 * 60 * 24 * 7;
+		val = ret * 1000000 * 60 * 60 * 24 * 7;
 	else {
-		if (tmp) free(tmp);
-		warnx("invalid age: %s\n", *t);
-		return NULL;
-	}
-
-	struct timeval *tv = calloc(1, sizeof(struct timeval));
-
-	if (!tv) {
-		warn("calloc");
-		if (tmp) free(tmp);
-		return NULL;
+		log_warnx("invalid age: %s", *t);
+		return -1;
 	}
 
 	tv->tv_sec = (time_t)(val / 1000000);
 	tv->tv_usec = (suseconds_t)(val % 1000000);
 
-	if (tmp)
-		free(tmp);
-
-	return(tv);
-}
-
-static int glob_file(const char *path, char ***matches, size_t *count,
-		glob_t **pglob)
-{
-	int r;
-
-	if (path == NULL)
-		return -1;
-
-	if (*pglob == NULL) {
-		*pglob = calloc(1, sizeof(glob_t));
-		if (!*pglob) {
-			warn("calloc");
-			return -1;
-		}
-	}
-
-	r = glob(path, GLOB_NOSORT, NULL, *pglob);
-
-	if (r) {
-		if (r != GLOB_NOMATCH) warnx("glob returned %u", r);
-		*matches = NULL;
-		*count = 0;
-		globfree(*pglob);
-		*pglob = NULL;
-	} else {
-		*matches = (**pglob).gl_pathv;
-		*count = (**pglob).gl_pathc;
-	}
-
-	return r;
+	return 0;
 }
 
 /*static int unlinkfolder(const char *path)
@@ -494,168 +307,228 @@ errno = ENOSYS;
 return -1;
 }*/
 
-static int dummyunlink(const char *path)
+/*
+ * a removed path may still be cached as a parent, as an existing one or
+ * in a directory listing
+ */
+static void forget_path(const char *path)
 {
-	if (path)
-		fprintf(stderr, "dummyunlink(%s)\n", path);
-	errno = EPERM;
-	return -1;
+	dcache_invalidate(path);
+	mkpath_forget();
+	gc_invalidate(path);
 }
 
-static int rmfile(const char *path)
+/*
+   struct action actions = {
+// ?,	mode,		replace?
+{ 'f',	CREAT_FILE,	false,	
+};
+*/
+
+static rule_t *rules = NULL;
+static size_t nrules = 0;
+static size_t rules_size = 0;
+
+static rule_t *new_rule(void)
 {
-	if (!path) {
-		warnx("path is NULL");
-		errno = EINVAL;
-		return -1;
-	} else if (dummyunlink(path)) {
-		warn("unlink(%s)", path);
-		return -1;
+	rule_t *tmp;
+
+	if (nrules == rules_size) {
+		rules_size = rules_size ? rules_size * 2 : 64;
+		if ( !(tmp = realloc(rules, sizeof(rule_t) * rules_size)) )
+			err(1, "realloc");
+		rules = tmp;
 	}
 
-	return 0;
+	memset(&rules[nrules], 0, sizeof(rule_t));
+	return &rules[nrules++];
 }
 
-static void rmifold(const char *path, struct timeval *tv)
+/*
+ * As in systemd, only arguments that are a path or content take
+ * specifiers; any other is used as written, % and all.
+ */
+static int arg_has_specs(const rule_t *r)
 {
-	if ( !path || !tv || !*path )
-		return;
+	switch (r->act)
+	{
+		case CREAT_FILE:
+		case TRUNC_FILE:
+		case WRITE_ARG:
+		case CREATE_SYM:
+		case COPY:
+		case CHATTR:
+		case CHATTRR:
+		case ACL:
+		case ACLR:
+			return 1;
+		default:
+			return 0;
+	}
+}
 
-	struct stat sb;
-	int fd;
+/*
+ * Compile the path and argument templates of a rule. A rule that fails
+ * stays in the table, and so in the cache, but is never executed.
+ */
+static void compile_rule(rule_t *r)
+{
+	r->tpath = tmpl_compile(r->path);
+	r->targ = NULL;
 
-	if ( (fd = open(path, O_RDONLY)) == -1) {
-		warn("open(%s)", path);
-		return;
-	}
+	if ( r->tpath && r->arg && arg_has_specs(r) &&
+			!(r->targ = tmpl_compile(r->arg)) )
+		r->tpath = NULL;
 
-	if (fstat(fd, &sb) == -1 ) {
-		close(fd);
-		warn("fstat(%s)", path);
-		return;
-	}
+	if (!r->tpath)
+		log_warnx("%s:%u: ignoring line", r->file, r->line);
+}
 
-	close(fd);
+#define NFIELDS 7
 
-	if (S_ISDIR(sb.st_mode)) {
-		errno = ENOSYS;
-		warn("aged delete folder(%s)", path);
-		return;
-	} else {
-		printf("%s mtime=%lu now=%lu age=%lu\n",
-				path,
-				sb.st_mtime,
-				time(0),
-				tv->tv_sec);
+/*
+ * Decode a C style escape at *src into *dst, advancing both. Returns -1
+ * on an unknown or truncated escape.
+ */
+static int unescape(const char **src, char **dst)
+{
+	const char *s = *src;
+	int i, v = 0;
+
+	switch (*s)
+	{
+		case 'a':	*(*dst)++ = '\a';	break;
+		case 'b':	*(*dst)++ = '\b';	break;
+		case 'f':	*(*dst)++ = '\f';	break;
+		case 'n':	*(*dst)++ = '\n';	break;
+		case 'r':	*(*dst)++ = '\r';	break;
+		case 't':	*(*dst)++ = '\t';	break;
+		case 'v':	*(*dst)++ = '\v';	break;
+		case 's':	*(*dst)++ = ' ';	break;
+		case '\\':
+		case '"':
+		case '\'':	*(*dst)++ = *s;		break;
+		case 'x':
+			for (i = 1; i < 3; i++) {
+				if (!isxdigit((unsigned char)s[i]))
+					return -1;
+				v = v * 16 + (isdigit((unsigned char)s[i]) ?
+						s[i] - '0' : (tolower((unsigned char)s[i]) - 'a' + 10));
+			}
+			if (!v)
+				return -1;
+			*(*dst)++ = v;
+			s += 2;
+			break;
+		case '0': case '1': case '2': case '3':
+			for (i = 0; i < 3; i++) {
+				if (s[i] < '0' || s[i] > '7')
+					return -1;
+				v = v * 8 + s[i] - '0';
+			}
+			if (!v)
+				return -1;
+			*(*dst)++ = v;
+			s += 2;
+			break;
+		default:
+			return -1;
 	}
 
-	printf("rmifold(%s, %ld)\n", path, tv->tv_sec);
+	*src = s + 1;
+	return 0;
 }
 
-static int rmrf(const char *path)
+/*
+ * Split line in place into at most NFIELDS fields. The first six fields
+ * are whitespace separated and may be quoted with ' or "; the argument is
+ * the rest of the line. Backslash escapes are decoded in every field.
+ * Decoding never makes a field longer, so the result is written over the
+ * input. Returns the number of fields or -1 on a malformed line.
+ */
+static int split_line(char *line, char *fields[NFIELDS])
 {
-	if (!path) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	char *buf = NULL;
-	struct stat sb;
-	int fd = -1;
+	const char *src = line;
+	char *dst = line, quote;
+	int n = 0;
 
-	if ( (fd = open(path, O_RDONLY)) == -1) 
-		return fd;
+	while (n < NFIELDS)
+	{
+		while (isspace((unsigned char)*src))
+			src++;
 
-	if (fstat(fd, &sb) == -1) {
-		close(fd);
-		return -1;
-	}
+		if (!*src)
+			break;
 
-	close(fd);
+		fields[n] = dst;
 
-	DIR *d = opendir(path);
-	struct dirent *ent;
+		if (n == NFIELDS - 1) {
+			while (*src)
+				if (*src != '\\')
+					*dst++ = *src++;
+				else if (src++, unescape(&src, &dst))
+					return -1;
+			*dst = '\0';
+			n++;
+			break;
+		}
 
-	if (S_ISDIR(sb.st_mode)) {
-		if (!d) 
-			return -1;
+		quote = (*src == '"' || *src == '\'') ? *src++ : '\0';
 
-		while ( (ent = readdir(d)) )
+		while (*src)
 		{
-			if (is_dot(ent->d_name))
-				continue;
-
-			if ( (buf = pathcat(path, ent->d_name)) ) 
-			{
-				if (rmrf(buf)) {
-					free(buf);
-					break;
-				}
-				free(buf);
-			}
+			if (quote && *src == quote) {
+				src++;
+				quote = '\0';
+				if (*src && !isspace((unsigned char)*src))
+					return -1;
+				break;
+			} else if (!quote && isspace((unsigned char)*src))
+				break;
+			else if (*src != '\\')
+				*dst++ = *src++;
+			else if (src++, unescape(&src, &dst))
+				return -1;
 		}
 
-		closedir(d);
-
-		if (errno) 
+		if (quote)
 			return -1;
 
-	} else {
-		// FIXME set errno?
-		printf("not a dir\n");
-		return rmfile(path);
+		/* dst never passes src, so this cannot clobber unread input */
+		if (*src)
+			src++;
+		*dst++ = '\0';
+		n++;
 	}
 
-	return 0;
+	return n;
 }
 
 /*
-   struct action actions = {
-// ?,	mode,		replace?
-{ 'f',	CREAT_FILE,	false,	
-};
-*/
-
-static void process_line(const char *line)
+ * Parse and validate a single config line into a new rule. Nothing is
+ * executed here, see execute_rule(). line is modified in place, anything
+ * the rule keeps is copied to the arena.
+ */
+static void process_line(char *line, const char *file, unsigned lineno)
 {
 	if (line == NULL) 
 		return;
 
-	char *rawtype = NULL, *tmppath = NULL, *path = NULL; 
-	char *modet = NULL, *dest = NULL;
-	char *uidt = NULL, *gidt = NULL, *aget = NULL, *arg = NULL;
+	char *f[NFIELDS] = { NULL };
 	char type, suff = '\0';
 	int boot_only = 0, act = -1, subonly = 0;
 	int fields = 0, defmode = 0;
-	char **globs = NULL;
-	size_t nglobs = 0;
-	glob_t *fileglob = NULL;
-	int fd = -1;
-
-	uid_t uid = 0; int defuid = 0;
-	gid_t gid = 0; int defgid = 0;
-	mode_t mode = 0; int mask = 0;
-	dev_t dev = 0;
+	int defuid = 0, defgid = 0, mask = 0;
+	struct timeval age;
+	rule_t *r;
 
-	struct timeval *age = NULL;
-
-	fields = sscanf(line, 
-			"%ms %ms %ms %ms %ms %ms %m[^\n]s",
-			&rawtype, &tmppath, &modet, &uidt, &gidt, &aget, &arg);
-
-	if ( prefix && strncmp(prefix, tmppath, strlen(prefix)) )
-		goto cleanup;
-
-	if ( exclude && !strncmp(exclude, tmppath, strlen(exclude)) )
-		goto cleanup;
+	fields = split_line(line, f);
 
 	if ( fields < 2 ) {
-		warnx("bad line: %s\n", line);
-		goto cleanup;
+		log_warnx("%s:%u: bad line", file, lineno);
 		return;
-	} else if ( validate_type(rawtype, &type, &suff, &boot_only) ) {
-		warnx("bad type: %s\n", line);
-		goto cleanup;
+	} else if ( validate_type(f[0], &type, &suff, &boot_only) ) {
+		log_warnx("%s:%u: bad type: %s", file, lineno, f[0]);
 		return;
 	} else {
 		switch(type)
@@ -682,47 +555,160 @@ static void process_line(const char *line)
 			case 'a':	act = ACL;			break;
 			case 'A':	act = ACLR;			break;
 			default:
-						warnx("unknown type: %s\n", line);
-						goto cleanup;
+						log_warnx("%s:%u: unknown type: %s", file, lineno, f[0]);
 						return;
 		}
 	}
 
-	path = pathcat(root, tmppath);
-	free(tmppath);
+	r = new_rule();
+	r->type = type;
+	r->suff = suff;
+	r->act = act;
+	r->file = file;
+	r->line = lineno;
+	r->path = arena_strdup(f[1]);
+	r->arg = arena_strdup(f[6]);
+
+	if (boot_only) r->flags |= RF_BOOT;
 
-	if (uidt) uid = vet_uid((const char **)&uidt, &defuid);
-	if (gidt) gid = vet_gid((const char **)&gidt, &defgid);
-	if (modet) mode = vet_mode((const char **)&modet, &mask, &defmode);
+	compile_rule(r);
+
+	if (f[3]) r->uid = vet_uid((const char **)&f[3], &defuid);
+	if (f[4]) r->gid = vet_gid((const char **)&f[4], &defgid);
+	if (f[2]) r->mode = vet_mode((const char **)&f[2], &mask, &defmode);
 	// FIXME handle '~'
-	if (aget) age = vet_age((const char **)&aget, &subonly);
-	if (path) path = vet_path(path);
+	if (f[5] && !vet_age((const char **)&f[5], &age, &subonly)) {
+		r->age = age;
+		r->flags |= RF_AGE;
+	}
+
+	if (defuid) r->flags |= RF_DEFUID;
+	if (defgid) r->flags |= RF_DEFGID;
+	if (defmode) r->flags |= RF_DEFMODE;
+	if (mask) r->flags |= RF_MASK;
+	if (subonly) r->flags |= RF_SUBONLY;
+}
+
+#undef NFIELDS
+
+/*
+ * Decide whether the node named by d should be created. An existing node
+ * is only replaced for the '+' form of a type.
+ */
+static int want_node(const dref_t *d, const char *path, char suff)
+{
+	struct stat sb;
+
+	if (fstatat(d->fd, d->name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+		if (errno == ENOENT) {
+			gc_invalidate(path);
+			return 1;
+		}
+		rwarn("stat(%s)", path);
+		return 0;
+	}
+
+	if (suff != '+')
+		return 0;
+
+	if (rm_tree(d->fd, d->name, path, RM_RECURSE))
+		return 0;
+	forget_path(path);
+
+	return 1;
+}
+
+/*
+ * Parse a "major:minor" device argument.
+ */
+static int vet_dev(const char *arg, dev_t *dev)
+{
+	unsigned long maj, min;
+	char *end;
+
+	if (!arg || !isdigit((unsigned char)*arg))
+		return -1;
+
+	maj = strtoul(arg, &end, 10);
+	if (*end != ':' || !isdigit((unsigned char)end[1]))
+		return -1;
+
+	min = strtoul(end + 1, &end, 10);
+	if (*end)
+		return -1;
+
+	*dev = makedev(maj, min);
+	return 0;
+}
+
+static void execute_rule(const rule_t *r)
+{
+	char pbuf[PATH_MAX], dbuf[PATH_MAX], abuf[PATH_MAX];
+	char *path = NULL, *dest = NULL;
+	const char *arg = NULL;
+	char **globs = NULL;
+	size_t nglobs = 0;
+	int fd = -1;
+
+	uid_t uid = r->uid; int defuid = r->flags & RF_DEFUID;
+	gid_t gid = r->gid; int defgid = r->flags & RF_DEFGID;
+	mode_t mode = r->mode; int mask = r->flags & RF_MASK;
+	int defmode = r->flags & RF_DEFMODE;
+	int subonly = r->flags & RF_SUBONLY;
+	const struct timeval *age = (r->flags & RF_AGE) ? &r->age : NULL;
+	dev_t dev = 0;
+	mphase_t ph;
+	dref_t dir = { -1, -1, NULL };
+
+	if ( prefix && strncmp(prefix, r->xpath, strlen(prefix)) )
+		return;
+
+	if ( exclude && !strncmp(exclude, r->xpath, strlen(exclude)) )
+		return;
+
+	if ( !(path = pathcpy(pbuf, sizeof(pbuf), root, r->xpath)) )
+		return;
+
+	metrics_rule(r);
+	TRACE4(rule__start, r->file, r->line, path, r->type);
+	log_msg(LV_INFO, "%s:%u: %c %s", r->file ? r->file : "-", r->line,
+			r->type, path);
+
+	if ( r->targ && !(arg = tmpl_expand(r->targ, abuf, sizeof(abuf))) ) {
+		rwarnx("argument too long: %s", r->arg);
+		TRACE4(rule__done, r->file, r->line, path, r->type);
+		metrics_rule(NULL);
+		return;
+	}
+	if (!r->targ)
+		arg = r->arg;
 
 	int i;
 
-	if ( (do_boot && boot_only) || !boot_only ) {
-		switch(act)
+	if ( (do_boot && (r->flags & RF_BOOT)) || !(r->flags & RF_BOOT) ) {
+		switch(r->act)
 		{
 
-			/* w - Write the argument parameter to a file
+			/* w - Write the argument parameter to a file, if it exists
+			 * w+ - Append it instead
 			 *
 			 * Argument:
-			 * For f, F, and w may be used to specify a short string
-			 * that is written to the file, suffixed by a newline
+			 * The string written, with escapes already decoded when the
+			 * line was read, and no newline added
 			 */
 			case WRITE_ARG:
-				glob_file(path, &globs, &nglobs, &fileglob);
-				if (do_create || do_clean)
-				{
-					dest = pathcat(root, arg);
-					for (i=0; i<(int)nglobs; i++) {
-						printf("[%u] write %s=%s %s%s", i, path, dest, 
-								do_clean ? "clean " : "",
-								do_create ? "create " : "");
-						if (do_clean && age)
-							printf("age=%lu", age->tv_sec);
-						puts("\n");
+				if (do_create) {
+					size_t failed;
+
+					if (!arg || !*arg) {
+						rwarnx("%s: nothing to write", path);
+						break;
 					}
+
+					gc_glob(path, &globs, &nglobs);
+					failed = write_files(globs, nglobs, arg, strlen(arg),
+							r->suff == '+', jobs);
+					metrics_add(M_ERRORS, failed);
 				}
 				break;
 
@@ -736,14 +722,12 @@ static void process_line(const char *line)
 			case RM:
 			case RMRF:
 				if (!do_remove) break;
-				glob_file(path, &globs, &nglobs, &fileglob);
+				gc_glob(path, &globs, &nglobs);
 				for (i=0;i<(int)nglobs;i++)
 				{
-					if (act&0x1) {
-						if (rmrf(globs[i]))
-							warn("rmrf(%s)",globs[i]);
-					} else rmfile(globs[i]);
-
+					rm_tree(AT_FDCWD, globs[i], globs[i],
+							RM_BUDGET | (r->act == RMRF ? RM_RECURSE : 0));
+					forget_path(globs[i]);
 				}
 				break;
 
@@ -755,22 +739,8 @@ static void process_line(const char *line)
 				 */
 			case IGN:
 			case IGNR:
-				glob_file(path, &globs, &nglobs, &fileglob);
-				for (i=0; i<(int)nglobs; i++)
-				{
-					ignores = realloc( ignores, (sizeof(ignent_t) * (ignores_size+1)) );
-					if (!ignores) {
-						warn("realloc");
-						break;
-					}
-
-					strncpy(ignores[ignores_size].path, globs[i], PATH_MAX);
-					ignores[ignores_size].contents = (act == IGN) ? true : false;
-					ignores_size++;
-
-					printf("[%u] ignore/r %s\n", 
-							i, globs[i]);
-				}
+				/* patterns are kept as such, not expanded to what exists now */
+				ign_add(path, r->act == IGN ? IGN_SELF : IGN_TREE);
 				break;
 
 				/* z - Adjust the access mode, group and user, and restore the 
@@ -782,36 +752,49 @@ static void process_line(const char *line)
 				 */
 			case CHMOD:
 			case CHMODR:
-				glob_file(path, &globs, &nglobs, &fileglob);
+				gc_glob(path, &globs, &nglobs);
 				struct stat sb;
 				if (do_create) {
 					mode_t mmode = mode;
 
 					for (i=0; i<(int)nglobs; i++) {
 
+						if (dcache_get(globs[i], &dir)) {
+							rwarn("open(%s)", globs[i]);
+							continue;
+						}
+
+						if (fstatat(dir.fd, dir.name, &sb,
+									AT_SYMLINK_NOFOLLOW) == -1) {
+							rwarn("stat(%s)", globs[i]);
+							dcache_put(&dir);
+							continue;
+						}
+
 						if (defmode) {
-							if (stat(globs[i], &sb) == -1)
-								warn("stat(%s)", globs[i]);
-							else {
-								if (S_ISDIR(sb.st_mode)) 
-									mmode = DEF_FOLD;
-								else
-									mmode = DEF_FILE;
-							}
+							if (S_ISDIR(sb.st_mode)) 
+								mmode = DEF_FOLD;
+							else
+								mmode = DEF_FILE;
 						} 
 
-						if (mask) {
+						/* fchmodat() would follow it and change the target */
+						if (S_ISLNK(sb.st_mode))
+							;
+						else if (mask) {
 							errno = ENOSYS;
-							warn("chmod(%s,%s)", globs[i], modet);
-						} else {
-							warnx("chmod(%s,%u)", globs[i], mmode);
-
-							if (chmod(globs[i], mmode))
-								warn("chmod(%s,%s)", globs[i], modet);
-						}
-						if (chown(globs[i], defuid ? -1 : uid, 
-									defgid ? -1 : gid))
-							warn("chown(%s,%s,%s)", globs[i], uidt, gidt);
+							rwarn("chmod(%s,%o)", globs[i], mmode);
+						} else if (fchmodat(dir.fd, dir.name, mmode, 0))
+							rwarn("chmod(%s,%o)", globs[i], mmode);
+
+						if (fchownat(dir.fd, dir.name,
+									defuid ? (uid_t)-1 : uid,
+									defgid ? (gid_t)-1 : gid,
+									AT_SYMLINK_NOFOLLOW))
+							rwarn("chown(%s,%d,%d)", globs[i],
+								defuid ? -1 : (int)uid, defgid ? -1 : (int)gid);
+
+						dcache_put(&dir);
 					}
 				}
 				break;
@@ -825,12 +808,11 @@ static void process_line(const char *line)
 				 */
 			case CHATTR:
 			case CHATTRR:
-				glob_file(path, &globs, &nglobs, &fileglob);
+				gc_glob(path, &globs, &nglobs);
 				if (do_create) {
-					dest = pathcat(root, arg);
-					for (i=0; i<(int)nglobs; i++) {
-						printf("[%u] path=%s dest=%s\n", i, globs[i], dest);
-					}
+					dest = pathcpy(dbuf, sizeof(dbuf), root, arg);
+					for (i=0; i<(int)nglobs && log_on(LV_DEBUG); i++)
+						log_msg(LV_DEBUG, "[%u] path=%s dest=%s", i, globs[i], dest);
 				}
 				//printf("chattr/chattrr\n\n");
 				break;
@@ -845,12 +827,11 @@ static void process_line(const char *line)
 				 */
 			case ACL:
 			case ACLR:
-				glob_file(path, &globs, &nglobs, &fileglob);
+				gc_glob(path, &globs, &nglobs);
 				if (do_create) {
-					dest = pathcat(root, arg);
-					for (i=0; i<(int)nglobs; i++) {
-						printf("[%u] path=%s dest=%s\n", i, globs[i], dest);
-					}
+					dest = pathcpy(dbuf, sizeof(dbuf), root, arg);
+					for (i=0; i<(int)nglobs && log_on(LV_DEBUG); i++)
+						log_msg(LV_DEBUG, "[%u] path=%s dest=%s", i, globs[i], dest);
 				}
 				break;
 
@@ -858,44 +839,25 @@ static void process_line(const char *line)
 				*/
 			case CREATE_SVOL:
 				//				errno = ENOSYS;
-				//				warn("subvol(%s)", path);
+				//				rwarn("subvol(%s)", path);
 
 				/* d - create a directory (if does not exist)
 				 * D - create a direcotry (delete contents if exists)
 				 */
 			case MKDIR:
 			case MKDIR_RMF:
-				if ( (do_clean && age) || (do_remove && act == MKDIR_RMF) ) {
-					//printf("mkdir do_clean age=%lu\n", age->tv_sec);
-					if (subonly) {
-						DIR *dirp = opendir(path);
-						struct dirent *dirent;
-						char *buf;
-
-						if (!dirp) break;
-
-						while ( (dirent = readdir(dirp)) != NULL )
-						{
-							if ( is_dot(dirent->d_name) )
-								continue;
-
-							if ( (buf = pathcat(path, dirent->d_name)) )
-							{
-								if (do_clean && age)
-									rmifold(buf, age);
-								else
-									dummyunlink(buf);
-								free(buf);
-							}
-
-						}
+				/* the daemon schedules its own cleaning */
+				if (do_clean && age && !do_daemon) {
+					metrics_begin(&ph);
+					clean_path(path, age, subonly, ign_check, NULL);
+					metrics_end(P_CLEAN, &ph);
+					gc_invalidate(path);
+				}
 
-					} else {
-						if (do_clean && age)
-							rmifold(path, age);
-						else
-							dummyunlink(path);
-					}
+				if (do_remove && r->act == MKDIR_RMF) {
+					rm_tree(AT_FDCWD, path, path,
+							RM_RECURSE|RM_CONTENTS|RM_BUDGET);
+					forget_path(path);
 				}
 
 				if (do_create) {
@@ -905,20 +867,17 @@ static void process_line(const char *line)
 					   printf("MKDIR %s [%d] %u %u %u\n", path, defmode, 
 					   (defmode ? DEF_FOLD : mode), uid, gid);
 					   */
-					fd = open(path, O_DIRECTORY|O_RDONLY);
-					if (fd == -1 && errno != ENOENT) break;
-					else if (fd != -1 && !(act&0x1)) break;
-					else if (fd != -1 && rmrf(path))
-						warn("rmrf(%s)", path);
-
-					if (fd != -1)
-						close(fd);
+					if ( (fd = mkpath(path, (defmode ? DEF_FOLD : mode))) == -1 ) {
+						rwarn("mkpath(%s)", path);
+						break;
+					}
+					gc_invalidate(path);
 
-					fd = mkpath(path, (defmode ? DEF_FOLD : mode));
-					if (fd == -1)
-						warn("mkpathr(%s)", path);
-					else if (fchown(fd, uid, gid))
-						warn("fchown(%s)", path);
+					if (fchown(fd, uid, gid))
+						rwarn("fchown(%s)", path);
+					/* mkdir() is subject to the umask, an explicit mode is not */
+					if (!defmode && fchmod(fd, mode))
+						rwarn("fchmod(%s)", path);
 				}
 
 				break;
@@ -932,13 +891,29 @@ static void process_line(const char *line)
 			case CREAT_FILE:
 			case TRUNC_FILE:
 				if (do_create) {
-					fd = open(path, 
-							O_CREAT|( (act & 0x1) ? O_TRUNC:0 ),
+					if (dcache_get(path, &dir)) {
+						rwarn("open(%s)", path);
+						break;
+					}
+
+					/* exclusive first, to tell whether it was created */
+					fd = openat(dir.fd, dir.name,
+							O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC|
+							( (r->act & 0x1) ? O_WRONLY|O_TRUNC : O_RDONLY ),
 							(defmode ? DEF_FILE : mode)
 							);
-					if (fd == -1) warn("open(%s)", path);
-					else if (fchown(fd, uid, gid))
-						warn("fchown(%s)", path);
+					if (fd != -1)
+						metrics_add(M_CREATED, 1);
+					else if (errno == EEXIST)
+						fd = openat(dir.fd, dir.name, O_NOFOLLOW|O_CLOEXEC|
+								( (r->act & 0x1) ? O_WRONLY|O_TRUNC : O_RDONLY ));
+
+					if (fd == -1) rwarn("open(%s)", path);
+					else {
+						gc_invalidate(path);
+						if (fchown(fd, uid, gid))
+							rwarn("fchown(%s)", path);
+					}
 				}
 				break;
 
@@ -950,8 +925,21 @@ static void process_line(const char *line)
 				 */
 			case COPY:
 				if (do_create) {
-					dest = pathcat(root, arg);
-					printf("src=%s\n", dest);
+					size_t created;
+
+					if (arg && *arg)
+						dest = pathcpy(dbuf, sizeof(dbuf), root, arg);
+					else if (snprintf(abuf, sizeof(abuf), FACTORY_DIR "%s",
+								r->xpath) < (int)sizeof(abuf))
+						dest = pathcpy(dbuf, sizeof(dbuf), root, abuf);
+					if (!dest) {
+						rwarnx("source too long: %s", path);
+						break;
+					}
+
+					if (copy_tree(dest, path, jobs, &created))
+						metrics_add(M_ERRORS, 1);
+					metrics_add(M_CREATED, created);
 				}
 				break;
 
@@ -962,18 +950,22 @@ static void process_line(const char *line)
 				 */
 			case CREATE_PIPE:
 				if (do_create) {
-					fd = open(path, O_RDONLY);
-					if (fd == -1 && errno != ENOENT) break;
-					else if (fd != -1 && suff != '~') break;
-					else if (fd != -1) dummyunlink(path);
+					if (dcache_get(path, &dir)) {
+						rwarn("open(%s)", path);
+						break;
+					}
 
-					if (fd != -1)
-						close(fd);
+					if (!want_node(&dir, path, r->suff))
+						break;
+
+					if (mkfifoat(dir.fd, dir.name, (defmode ? DEF_FILE : mode))) {
+						rwarn("mkfifo(%s)", path);
+						break;
+					}
+					metrics_add(M_CREATED, 1);
 
-					if ( (fd = mkfifo(path, mode)) )
-						warn("mkfifo(%s)", path);
-					else if (fchown(fd, uid, gid))
-						warn("fchown(%s)", path);
+					if (fchownat(dir.fd, dir.name, uid, gid, AT_SYMLINK_NOFOLLOW))
+						rwarn("fchown(%s)", path);
 				}
 				break;
 
@@ -982,67 +974,79 @@ static void process_line(const char *line)
 				 *
 				 * Mode: ignored
 				 * UID/GID: ignored
-				 * Argument: if empty, symlink to /usr/share/factory/$NAME
+				 * Argument: the target, below root unless it starts with
+				 *           "../". If empty, /usr/share/factory/$NAME
+				 *           below root, as for C
 				 */
-			case CREATE_SYM: // FIXME handle NULL dest => /usr/share/factory
+			case CREATE_SYM:
 				if (do_create) {
-					if (strncmp("../", arg, 3) )
-						dest = pathcat(root, arg);
+					if (!arg || !*arg) {
+						if (snprintf(abuf, sizeof(abuf), FACTORY_DIR "%s",
+									r->xpath) < (int)sizeof(abuf))
+							dest = pathcpy(dbuf, sizeof(dbuf), root, abuf);
+					} else if (strncmp("../", arg, 3))
+						dest = pathcpy(dbuf, sizeof(dbuf), root, arg);
 					else
-						dest = strdup(arg);
+						dest = (char *)arg;
+					if (!dest) {
+						rwarnx("target too long: %s", path);
+						break;
+					}
 
-					fd = open(path, O_RDONLY);
-					if (fd == -1 && errno != ENOENT) break;
-					else if (fd != -1 && suff != '~') break;
-					else if (fd != -1 && dummyunlink(path)) 
-						warn("unlink(%s)", path);
-					if (fd != -1)
-						close(fd);
+					if (dcache_get(path, &dir)) {
+						rwarn("open(%s)", path);
+						break;
+					}
 
-					fd = symlink(dest, path);
-					if (fd == -1)
-						warn("symlink(%s, %s)", dest, path);
-					else {
-						// FIXME - should this be DEF only or not used?
-						if (fchown(fd, uid, gid))
-							warn("fchown(%s)", path);
-						if (fchmod(fd, (defmode ? DEF_FOLD : mode)))
-							warn("fchmod(%s)", path);
+					if (!want_node(&dir, path, r->suff))
+						break;
+
+					/* the mode of a symlink is meaningless on Linux */
+					if (symlinkat(dest, dir.fd, dir.name)) {
+						rwarn("symlink(%s, %s)", dest, path);
+						break;
 					}
+					metrics_add(M_CREATED, 1);
+
+					if (fchownat(dir.fd, dir.name, uid, gid, AT_SYMLINK_NOFOLLOW))
+						rwarn("fchown(%s)", path);
 				}
 				break;
 
-				/* c - Create a pipe (FIFO) if it does not exist
-				 * c+ - Remove and create a pipe (FIFO)
+				/* c - Create a character device node if it does not exist
+				 * c+ - Remove and create a character device node
+				 * b - Create a block device node if it does not exist
+				 * b+ - Remove and create a block device node
 				 *
-				 * Argument: ignored
+				 * Argument: major:minor of the device
 				 */
 			case CREATE_CHAR:
+			case CREATE_BLK:
 				if (do_create) {
-					fd = open(path, O_RDONLY);
-					if (fd == -1 && errno != ENOENT) break;
-					if (fd != -1 && suff != '~') break;
-					else if (fd != -1) dummyunlink(path);
+					if (vet_dev(arg, &dev)) {
+						rwarnx("%s:%u: invalid device: %s", r->file, r->line,
+								arg ? arg : "");
+						break;
+					}
 
-					if (fd != -1)
-						close(fd);
+					if (dcache_get(path, &dir)) {
+						rwarn("open(%s)", path);
+						break;
+					}
 
-					if ( (fd = mknod(path, (defmode ? 
-										DEF_FILE : mode)|S_IFCHR, dev)) )
-						warn("mknod(%s)", path);
-					else if (fchown(fd, uid, gid))
-						warn("fchown(%s)", path);
-				}
-				break;
+					if (!want_node(&dir, path, r->suff))
+						break;
 
-				/* b - Create a pipe (FIFO) if it does not exist
-				 * b+ - Remove and create a pipe (FIFO)
-				 *
-				 * Argument: ignored
-				 */
-			case CREATE_BLK:
-				if (do_create) {
-					dest = pathcat(root, arg);
+					if (mknodat(dir.fd, dir.name, (defmode ? DEF_FILE : mode)|
+								(r->act == CREATE_CHAR ? S_IFCHR : S_IFBLK), 
+								dev)) {
+						rwarn("mknod(%s)", path);
+						break;
+					}
+					metrics_add(M_CREATED, 1);
+
+					if (fchownat(dir.fd, dir.name, uid, gid, AT_SYMLINK_NOFOLLOW))
+						rwarn("fchown(%s)", path);
 				}
 				break;
 			default:
@@ -1050,115 +1054,502 @@ static void process_line(const char *line)
 		}
 	}
 
-cleanup:
-
 	if (fd != -1) 
 		close(fd);
-	if (rawtype) 
-		free(rawtype);
-	if (path) 
-		free(path);
-	if (modet) 
-		free(modet);
-	if (uidt) 
-		free(uidt);
-	if (gidt)
-		free(gidt);
-	if (aget) 
-		free(aget);
-	if (arg) 
-		free(arg);
-	if (dest)
-		free(dest);
-	if (fileglob) 
-		globfree(fileglob);
+	if (dir.fd != -1)
+		dcache_put(&dir);
+	if (globs)
+		gc_free(globs, nglobs);
+
+	TRACE4(rule__done, r->file, r->line, path, r->type);
+	metrics_rule(NULL);
+}
+
+/*
+ * Orders rules by what they do, leaving out where they were written and
+ * their age, which only the cleaning looks at.
+ */
+static int rule_cmp(const void *a, const void *b)
+{
+	const rule_t *ra = *(rule_t * const *)a, *rb = *(rule_t * const *)b;
+	const unsigned keep = ~(RF_AGE|RF_SUBONLY);
+	int r;
+
+	if ( (r = strcmp(ra->path, rb->path)) )
+		return r;
+	if (ra->type != rb->type)
+		return ra->type - rb->type;
+	if (ra->suff != rb->suff)
+		return ra->suff - rb->suff;
+	if ((ra->flags & keep) != (rb->flags & keep))
+		return (ra->flags & keep) < (rb->flags & keep) ? -1 : 1;
+	if (ra->mode != rb->mode)
+		return ra->mode < rb->mode ? -1 : 1;
+	if (ra->uid != rb->uid)
+		return ra->uid < rb->uid ? -1 : 1;
+	if (ra->gid != rb->gid)
+		return ra->gid < rb->gid ? -1 : 1;
+	if (!ra->arg || !rb->arg)
+		return !!ra->arg - !!rb->arg;
+
+	return strcmp(ra->arg, rb->arg);
+}
+
+/*
+ * Load every rule into the rule table, dropping duplicates, then hand the
+ * survivors to the executor. Given the rules in effect before a reload,
+ * only those that are new or changed are run, plus every x/X rule as the
+ * ignores were reset.
+ */
+static void execute_rules(rule_t *old, size_t nold)
+{
+	rule_t **tab, **sorted = NULL, *r;
+	size_t i, n, m;
+	mphase_t ph;
+
+	for (i = 0; i < nrules; i++)
+		ruletab_add(&rules[i]);
+
+	tab = ruletab_rules(&n);
+
+	if (old) {
+		if ( !(sorted = calloc(nold ? nold : 1, sizeof(rule_t *))) )
+			err(EXIT_FAILURE, "calloc");
+		for (i = 0; i < nold; i++)
+			sorted[i] = &old[i];
+		qsort(sorted, nold, sizeof(rule_t *), rule_cmp);
+
+		for (i = m = 0; i < n; i++) {
+			r = tab[i];
+			if (r->act == IGN || r->act == IGNR ||
+					!bsearch(&r, sorted, nold, sizeof(rule_t *), rule_cmp))
+				tab[m++] = r;
+		}
+		n = m;
+		free(sorted);
+	}
+
+	metrics_begin(&ph);
+	exec_run(tab, n, jobs, execute_rule);
+	metrics_end(P_EXECUTE, &ph);
 }
 
 static void process_file(const char *file, const char *folder)
 {
 	char *in = NULL;
-	int len = 0;
+	size_t len = 0;
 	char *line = NULL;
 	ssize_t cnt = 0;
 	size_t ignore = 0;
+	unsigned lineno = 0;
 
 	if (file == NULL) {
-		warnx("file is NULL");
+		log_warnx("file is NULL");
 		return;
 	}
 
+	/* rules refer to in for as long as they exist */
 	if (folder) {
-		if ( !(in = calloc(1, (len = strlen(file) + 
-							strlen(folder) + 2))) ) {
-			warn("calloc");
-			return;
-		}
+		in = arena_alloc( (len = strlen(file) + strlen(folder) + 2) );
 		snprintf(in, len, "%s/%s", folder, file);
 	} else {
-		in = strdup(file);
+		in = arena_strdup(file);
 	}
 
 	//printf("processing %s\n", in);
 
-	if (ignores) {
-		ignores_size = 0;
-		free(ignores);
-		ignores = NULL;
-	}
+	cache_track(in);
 
 	FILE *fp;
 
 	if ( (fp = fopen(in, "r")) != NULL) {
+		/* the line buffer is reused, process_line() copies what it keeps */
 		while( (cnt = getline(&line, &ignore, fp)) != -1 )
 		{
-			if (line == NULL) continue;
-
-			line = trim(line);
-			if (cnt != 1 && line[0] != '#')
-				process_line(line);
+			lineno++;
 
-			free(line);
-			line = NULL;
+			trim(line);
+			if (*line && line[0] != '#')
+				process_line(line, in, lineno);
 		}
 
+		free(line);
 		fclose(fp);
 	} else
-		warn("fopen");
-
-	free(in);
+		log_warn("fopen(%s)", in);
 }
 
 #define CFG_EXT ".conf"
 #define CFG_EXT_LEN sizeof(CFG_EXT)
 
-static void process_folder(const char *folder)
+/*
+ * Search path for tmpfiles.d, highest priority first. A file in an earlier
+ * folder masks any file with the same basename in a later one.
+ */
+static const char *const config_dirs[] = {
+	"/etc/tmpfiles.d",
+	"/run/tmpfiles.d",
+	"/usr/lib/tmpfiles.d",
+	NULL
+};
+
+typedef struct confent {
+	char *name;
+	char *folder;
+	int prio;
+} confent_t;
+
+static confent_t *confindex = NULL;
+static size_t confindex_size = 0, confindex_alloc = 0;
+
+static int has_cfg_ext(const char *name)
+{
+	size_t len = strlen(name);
+
+	if ( len < CFG_EXT_LEN )
+		return 0;
+
+	return !strcmp(name + len - CFG_EXT_LEN + 1, CFG_EXT);
+}
+
+static int confent_cmp(const void *a, const void *b)
+{
+	const confent_t *ca = a, *cb = b;
+	int r;
+
+	if ( (r = strcmp(ca->name, cb->name)) )
+		return r;
+
+	return ca->prio - cb->prio;
+}
+
+static void index_folder(const char *folder, int prio)
 {
 	DIR *dirp;
 	struct dirent *dirent;
-	int len;
+	confent_t *tmp;
+	size_t n;
+
+	cache_track(folder);
 
-	//printf("checking folder: %s\n", folder);
 	if ( !(dirp = opendir(folder)) ) {
-		warn("opendir(%s)", folder);
+		if (errno != ENOENT)
+			log_warn("opendir(%s)", folder);
 		return;
 	}
 
+	/* the index refers to it until the next reload */
+	folder = arena_strdup(folder);
+
 	while( (dirent = readdir(dirp)) )
 	{
 		if ( is_dot(dirent->d_name) )
 			continue;
-		if ( (len = strlen(dirent->d_name)) <= (int)CFG_EXT_LEN ) 
+		if ( !has_cfg_ext(dirent->d_name) )
 			continue;
-		if ( strncmp(dirent->d_name + len - CFG_EXT_LEN + 1, CFG_EXT, 
-					CFG_EXT_LEN) ) 
+
+		if (confindex_size == confindex_alloc) {
+			n = confindex_alloc ? confindex_alloc * 2 : 64;
+			if ( !(tmp = realloc(confindex, sizeof(confent_t) * n)) ) {
+				log_warn("realloc");
+				break;
+			}
+			confindex = tmp;
+			confindex_alloc = n;
+		}
+
+		confindex[confindex_size].name = strdup(dirent->d_name);
+		confindex[confindex_size].folder = (char *)folder;
+		confindex[confindex_size].prio = prio;
+		confindex_size++;
+	}
+
+	closedir(dirp);
+}
+
+/*
+ * A file symlinked to /dev/null masks the same name in lower priority
+ * folders without providing any rules itself.
+ */
+static int is_masked(const char *file, const char *folder)
+{
+	char buf[PATH_MAX], lnk[sizeof("/dev/null")];
+	ssize_t len;
+
+	snprintf(buf, sizeof(buf), "%s/%s", folder, file);
+
+	if ( (len = readlink(buf, lnk, sizeof(lnk) - 1)) == -1 )
+		return 0;
+
+	lnk[len] = '\0';
+	return !strcmp(lnk, "/dev/null");
+}
+
+/*
+ * Collect the basenames of every config file across all of config_dirs,
+ * keep only the highest priority copy of each, and sort them by name so
+ * the processing order does not depend on readdir().
+ */
+static void build_config_index(void)
+{
+	char pbuf[PATH_MAX];
+	size_t i, j;
+
+	for (i = 0; config_dirs[i]; i++)
+		if (pathcpy(pbuf, sizeof(pbuf), root, config_dirs[i]))
+			index_folder(pbuf, i);
+
+	if (!confindex_size)
+		return;
+
+	qsort(confindex, confindex_size, sizeof(confent_t), confent_cmp);
+
+	for (i = 1, j = 0; i < confindex_size; i++)
+	{
+		if ( !strcmp(confindex[i].name, confindex[j].name) ) {
+			free(confindex[i].name);
+			continue;
+		}
+		confindex[++j] = confindex[i];
+	}
+
+	confindex_size = j + 1;
+}
+
+static void process_config_index(void)
+{
+	size_t i;
+
+	for (i = 0; i < confindex_size; i++)
+	{
+		if ( is_masked(confindex[i].name, confindex[i].folder) )
 			continue;
-		process_file(dirent->d_name, folder);
+		process_file(confindex[i].name, confindex[i].folder);
 	}
 }
 
 #undef CFG_EXT
 #undef CFG_EXT_LEN
 
+/*
+ * Anything besides the config files that changes which rules are loaded
+ * must be part of the cache key.
+ */
+static char *cache_key(void)
+{
+	size_t len = strlen(root) + 2;
+	char *key;
+	int i;
+
+	for (i = 0; i < num_config_files; i++)
+		len += strlen(config_files[i]) + 1;
+
+	if ( !(key = calloc(1, len)) )
+		err(1, "calloc");
+
+	strcat(key, root);
+	strcat(key, "\n");
+	for (i = 0; i < num_config_files; i++) {
+		strcat(key, config_files[i]);
+		strcat(key, "\n");
+	}
+
+	return key;
+}
+
+/*
+ * The scan state holds for the rules that decide what cleaning removes:
+ * the aged directories and the x/X entries.
+ */
+static void state_key_rules(void)
+{
+	char *key = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	if ( !(fp = open_memstream(&key, &len)) )
+		err(EXIT_FAILURE, "open_memstream");
+
+	for (size_t i = 0; i < nrules; i++)
+	{
+		const rule_t *r = &rules[i];
+
+		if (r->act != IGN && r->act != IGNR && !(r->flags & RF_AGE))
+			continue;
+		fprintf(fp, "%c %s %lld.%06ld %x\n", r->type, r->path,
+				(long long)r->age.tv_sec, (long)r->age.tv_usec,
+				r->flags & RF_SUBONLY);
+	}
+
+	if (fclose(fp))
+		err(EXIT_FAILURE, "fclose");
+
+	state_key(key);
+	free(key);
+}
+
+static void load_rules(void)
+{
+	char pbuf[PATH_MAX];
+	mphase_t ph;
+
+	metrics_begin(&ph);
+
+	if ( cache_load(&rules, &nrules) ) {
+		/* names in rules are resolved against these */
+		if (pathcpy(pbuf, sizeof(pbuf), root, "/etc/passwd"))
+			cache_track(pbuf);
+		if (pathcpy(pbuf, sizeof(pbuf), root, "/etc/group"))
+			cache_track(pbuf);
+
+		build_config_index();
+		process_config_index();
+
+		for (int i = 0; i < num_config_files; i++)
+			if (pathcpy(pbuf, sizeof(pbuf), root, config_files[i]))
+				process_file(pbuf, NULL);
+
+		if (cache_enabled() && cache_save(rules, nrules))
+			log_warnx("unable to write cache %s", compile_cache);
+	} else {
+		rules_size = nrules;
+		for (size_t i = 0; i < nrules; i++)
+			compile_rule(&rules[i]);
+	}
+
+	if (state_enabled())
+		state_key_rules();
+
+	metrics_end(P_PARSE, &ph);
+}
+
+/*
+ * Hand the daemon every config folder and every directory with an aged
+ * d, D or v rule that this run would otherwise clean.
+ */
+static void daemon_setup(void)
+{
+	char pbuf[PATH_MAX];
+	const rule_t *r;
+	rule_t **tab;
+	char **globs;
+	size_t i, n, nglobs;
+
+	for (i = 0; config_dirs[i]; i++)
+		if (pathcpy(pbuf, sizeof(pbuf), root, config_dirs[i]))
+			dm_watch_config(pbuf);
+
+	if (!do_clean)
+		return;
+
+	tab = ruletab_rules(&n);
+	for (i = 0; i < n; i++)
+	{
+		r = tab[i];
+
+		if (r->act != MKDIR && r->act != MKDIR_RMF && r->act != CREATE_SVOL)
+			continue;
+		if ( !(r->flags & RF_AGE) || ((r->flags & RF_BOOT) && !do_boot) )
+			continue;
+		if ( prefix && strncmp(prefix, r->xpath, strlen(prefix)) )
+			continue;
+		if ( exclude && !strncmp(exclude, r->xpath, strlen(exclude)) )
+			continue;
+		if ( !pathcpy(pbuf, sizeof(pbuf), root, r->xpath) )
+			continue;
+
+		if (gc_glob(pbuf, &globs, &nglobs))
+			continue;
+		for (size_t j = 0; j < nglobs; j++)
+			dm_add(r, globs[j]);
+		gc_free(globs, nglobs);
+	}
+}
+
+/*
+ * Start over from the configs. Strings of the old rules live in the
+ * arena, which is only released on exit, so each reload costs the size
+ * of the configs.
+ *
+ * Of the new rules only those not in effect before are run, and only to
+ * create: removal is for the first run, and cleaning is left to the
+ * schedule rebuilt by daemon_setup().
+ */
+static void reload_rules(void)
+{
+	rule_t *old = rules;
+	size_t nold = nrules;
+
+	rules = NULL;
+	nrules = rules_size = 0;
+
+	for (size_t i = 0; i < confindex_size; i++)
+		free(confindex[i].name);
+	free(confindex);
+	confindex = NULL;
+	confindex_size = confindex_alloc = 0;
+
+	cache_reset();
+	idcache_reset();
+	ruletab_reset();
+	ign_reset();
+
+	/* whatever was cached may have changed since */
+	forget_path("/");
+
+	do_remove = false;
+	load_rules();
+	execute_rules(old, nold);
+	free(old);
+	daemon_setup();
+}
+
+static void on_stop(int sig)
+{
+	(void)sig;
+	clean_stop();
+}
+
+/*
+ * The one line a run logs unless it is quiet.
+ */
+static void summary(const struct timespec *start)
+{
+	/* a run from cron must stay quiet unless something went wrong */
+	int level = do_stats ? LV_NOTICE : LV_INFO;
+	struct timespec now;
+
+	if (!log_on(level))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	log_msg(level, "%zu rules in %.3fs: %" PRIu64 " created, %" PRIu64
+			" removed (%" PRIu64 " bytes), %" PRIu64 " errors", nrules,
+			(now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9,
+			metrics_total(M_CREATED), metrics_total(M_REMOVED),
+			metrics_total(M_BYTES), metrics_total(M_ERRORS));
+}
+
+static int clean_tree(const rule_t *r, const char *path, struct timespec *due)
+{
+	mphase_t ph;
+	int rc;
+
+	clean_init();
+	budget_start();
+	metrics_rule(r);
+	metrics_begin(&ph);
+	rc = clean_path(path, &r->age, r->flags & RF_SUBONLY, ign_check, due);
+	metrics_end(P_CLEAN, &ph);
+	metrics_rule(NULL);
+	gc_invalidate(path);
+
+	if (metrics_file)
+		metrics_textfile(metrics_file);
+
+	return rc;
+}
+
 static struct option long_options[] = {
 
 	{"create",			no_argument,		&do_create,		true},
@@ -1168,8 +1559,23 @@ static struct option long_options[] = {
 	{"prefix",			required_argument,	0,				'p'},
 	{"exclude-prefix",	required_argument,	0,				'e'},
 	{"root",			required_argument,	0,				'r'},
+	{"compile-cache",	required_argument,	0,				'c'},
+	{"jobs",			required_argument,	0,				'j'},
+	{"backend",			required_argument,	0,				'B'},
 	{"help",			no_argument,		&do_help,		true},
 	{"version",			no_argument,		&do_version,	true},
+	{"stats",			optional_argument,	0,				's'},
+	{"metrics-textfile",	required_argument,	0,				'M'},
+	{"daemon",			no_argument,		&do_daemon,		true},
+	{"state",			optional_argument,	0,				'S'},
+	{"ioprio",			required_argument,	0,				'I'},
+	{"nice",			required_argument,	0,				'N'},
+	{"max-ops-per-sec",	required_argument,	0,				'O'},
+	{"max-runtime",		required_argument,	0,				'T'},
+	{"quiet",			no_argument,		0,				'q'},
+	{"verbose",			no_argument,		0,				'v'},
+	{"log-level",		required_argument,	0,				'L'},
+	{"log-target",		required_argument,	0,				'G'},
 
 	{0,0,0,0}
 };
@@ -1177,13 +1583,16 @@ static struct option long_options[] = {
 
 int main(int argc, char * const argv[])
 {
+	struct timespec start;
 	int c, fail = 0;
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	while (1)
 	{
 		int option_index;
 
-		c = getopt_long(argc, argv, "h", long_options, &option_index);
+		c = getopt_long(argc, argv, "hj:qv", long_options, &option_index);
 
 		if (c == -1)
 			break;
@@ -1199,6 +1608,93 @@ int main(int argc, char * const argv[])
 			case 'r':
 				root = strdup(optarg);
 				break;
+			case 'c':
+				compile_cache = strdup(optarg);
+				break;
+			case 'S':
+				do_state = 1;
+				if (optarg)
+					state_file = strdup(optarg);
+				break;
+			case 's':
+				if (!optarg || !strcmp(optarg, "text"))
+					do_stats = STATS_TEXT;
+				else if (!strcmp(optarg, "json"))
+					do_stats = STATS_JSON;
+				else {
+					log_warnx("invalid stats format: %s", optarg);
+					fail = 1;
+				}
+				break;
+			case 'M':
+				metrics_file = strdup(optarg);
+				break;
+			case 'I':
+				if (budget_ioprio(optarg)) {
+					log_warnx("invalid ioprio: %s", optarg);
+					fail = 1;
+				}
+				break;
+			case 'N':
+				if (budget_nice(optarg)) {
+					log_warnx("invalid nice: %s", optarg);
+					fail = 1;
+				}
+				break;
+			case 'O':
+				if ( !isnumber(optarg) || !atol(optarg) ) {
+					log_warnx("invalid max-ops-per-sec: %s", optarg);
+					fail = 1;
+				} else
+					budget_rate(strtoul(optarg, NULL, 10));
+				break;
+			case 'T':
+				{
+					const char *t = optarg;
+					struct timeval tv;
+					int subonly;
+
+					if (vet_age(&t, &tv, &subonly) || subonly ||
+							(!tv.tv_sec && !tv.tv_usec)) {
+						log_warnx("invalid max-runtime: %s", optarg);
+						fail = 1;
+					} else
+						budget_runtime(&tv);
+				}
+				break;
+			case 'j':
+				if ( !isnumber(optarg) || !(jobs = atoi(optarg)) ) {
+					log_warnx("invalid jobs: %s", optarg);
+					fail = 1;
+				}
+				break;
+			case 'B':
+				if (io_init(optarg)) {
+					log_warnx("invalid backend: %s", optarg);
+					fail = 1;
+				}
+				break;
+			case 'q':
+				log_level = LV_ERROR;
+				break;
+			case 'v':
+				if (log_level < LV_DEBUG)
+					log_level = log_level < LV_NOTICE ? LV_INFO : log_level + 1;
+				break;
+			case 'L':
+				if ((log_level = log_parse_level(optarg)) == -1) {
+					log_level = LV_NOTICE;
+					log_warnx("invalid log level: %s", optarg);
+					fail = 1;
+				}
+				break;
+			case 'G':
+				if ((log_sink = log_parse_sink(optarg)) == -1) {
+					log_sink = SINK_STDERR;
+					log_warnx("invalid log target: %s", optarg);
+					fail = 1;
+				}
+				break;
 			case 'h':
 				do_help = 1;
 				break;
@@ -1234,17 +1730,59 @@ int main(int argc, char * const argv[])
 	if (!root)
 		root = "";
 
-	printf("tmpfilesd running\ndo_create=%d,do_clean=%d,"
-			"do_remove=%d,do_boot=%d\nroot=%s\n",
-			do_create, do_clean, do_remove, do_boot,
-			root);
+	log_open(log_sink);
+	log_msg(LV_DEBUG, "do_create=%d,do_clean=%d,do_remove=%d,do_boot=%d,root=%s",
+			do_create, do_clean, do_remove, do_boot, root);
+
+	/* the summary takes its counts from the metrics, but needs no timing */
+	if (do_stats == STATS_JSON || metrics_file)
+		metrics_init(true);
+	else if (do_stats || log_on(LV_INFO))
+		metrics_init(false);
+
+	atexit(arena_free);
+	spec_init(root);
+	idcache_init(root);
+	clean_init();
+
+	if (compile_cache)
+		cache_init(compile_cache, cache_key());
+
+	if (do_state) {
+		if (!state_file)
+			state_file = pathcat(root, STATE_DIR "/clean");
+		state_init(state_file);
+		/* what was cleaned so far is kept, the rest resumes next time */
+		if (!do_daemon) {
+			signal(SIGTERM, on_stop);
+			signal(SIGINT, on_stop);
+		}
+	}
+
+	/* before the workers are started, so they inherit it */
+	budget_apply();
+	budget_start();
+
+	load_rules();
+	execute_rules(NULL, 0);
+	summary(&start);
+
+	if (do_daemon) {
+		dm_init();
+		daemon_setup();
+		dm_run(reload_rules, clean_tree);
+	}
+
+	if (state_enabled() && state_save())
+		log_warnx("unable to write state %s", state_file);
 
-	process_folder(pathcat(root, "/etc/tmpfiles.d"));
-	process_folder(pathcat(root, "/run/tmpfiles.d"));
-	process_folder(pathcat(root, "/usr/lib/tmpfiles.d"));
+	if (do_stats == STATS_TEXT)
+		idcache_stats(stderr);
+	else if (do_stats == STATS_JSON)
+		metrics_json(stdout);
 
-	for (int i = 0; i < num_config_files; i++)
-		process_file(pathcat(root, config_files[i]), NULL);
+	if (metrics_file && metrics_textfile(metrics_file))
+		log_warnx("unable to write metrics %s", metrics_file);
 
 	exit(EXIT_SUCCESS);
 }
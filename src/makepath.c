@@ -1,75 +1,291 @@
-/* mkpath() -- Create all components leading up to a given directory
- *
- * Copyright (c) 2013-2016  Joachim Nilsson <troglobit@gmail.com>
- *
- * Permission to use, copy, modify, and/or distribute this software for any
- * purpose with or without fee is hereby granted, provided that the above
- * copyright notice and this permission notice appear in all copies.
- *
- * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
- * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
- * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
- * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
- * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
- * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
- * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
- */
+#define _GNU_SOURCE
 
-#define _XOPEN_SOURCE 700
-#include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
 #include <errno.h>
-#include <libgen.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <alloca.h>
-#include <string.h>
-//#include "lite.h"
 
-/**
- * mkpath - Like makepath() but takes a mode_t argument
- * @dir:  Directory to created, relative or absolute
- * @mode: A &mode_t mode to create @dir with
+#include "util.h"
+#include "iobackend.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
+
+/*
+ * Directories known to exist.
  *
- * Returns:
- * POSIX OK(0) on success, otherwise -1 with @errno set.
+ * Every directory mkpath() creates or finds on the way is remembered for
+ * the rest of the run, so a later rule under the same tree starts from its
+ * deepest known ancestor instead of from the root.
+ */
+
+typedef struct known {
+	char *path;
+	size_t len;
+	size_t hash;
+} known_t;
+
+static known_t *known = NULL;
+static size_t nknown = 0, known_used = 0;
+static pthread_mutex_t known_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t path_hash(const char *path, size_t len)
+{
+	size_t h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*path++) * 16777619u;
+
+	return h;
+}
+
+static known_t *known_find(const char *path, size_t len, size_t h)
+{
+	size_t i;
+
+	if (!nknown)
+		return NULL;
+
+	for (i = h & (nknown - 1); known[i].path; i = (i + 1) & (nknown - 1))
+		if (known[i].hash == h && known[i].len == len &&
+				!memcmp(known[i].path, path, len))
+			return &known[i];
+
+	return NULL;
+}
+
+static void known_insert(known_t *ent)
+{
+	size_t i;
+
+	for (i = ent->hash & (nknown - 1); known[i].path;
+			i = (i + 1) & (nknown - 1))
+		;
+
+	known[i] = *ent;
+	known_used++;
+}
+
+static void known_add(const char *path, size_t len)
+{
+	known_t ent, *old;
+	size_t i, oldsize;
+
+	ent.hash = path_hash(path, len);
+	ent.len = len;
+
+	pthread_mutex_lock(&known_lock);
+
+	if (known_find(path, len, ent.hash))
+		goto done;
+
+	if ( (known_used + 1) * 2 > nknown ) {
+		old = known;
+		oldsize = nknown;
+		nknown = nknown ? nknown * 2 : 256;
+		if ( !(known = calloc(nknown, sizeof(known_t))) ) {
+			log_warn("calloc");
+			known = old;
+			nknown = oldsize;
+			goto done;
+		}
+		known_used = 0;
+		for (i = 0; i < oldsize; i++)
+			if (old[i].path)
+				known_insert(&old[i]);
+		free(old);
+	}
+
+	if ( (ent.path = strndup(path, len)) )
+		known_insert(&ent);
+
+done:
+	pthread_mutex_unlock(&known_lock);
+}
+
+static bool is_known(const char *path, size_t len)
+{
+	bool ret;
+
+	pthread_mutex_lock(&known_lock);
+	ret = known_find(path, len, path_hash(path, len)) != NULL;
+	pthread_mutex_unlock(&known_lock);
+
+	return ret;
+}
+
+/*
+ * Forget every known directory, e.g. after part of a tree was removed.
  */
-int mkpath(char *dir, mode_t mode)
+void mkpath_forget(void)
 {
+	size_t i;
+
+	pthread_mutex_lock(&known_lock);
+	for (i = 0; i < nknown; i++) {
+		free(known[i].path);
+		known[i].path = NULL;
+	}
+	known_used = 0;
+	pthread_mutex_unlock(&known_lock);
+}
+
+static int mkpath_at(const char *dir, mode_t mode)
+{
+	char buf[PATH_MAX], *rel, *names, *name;
+	size_t len, base, pos, end, n, k, i;
+	int afd, fd, e, retried = 0;
 	struct stat sb;
+	ioop_t *ops = NULL;
 
-	if (!dir) {
+	if (!dir || *dir != '/') {
 		errno = EINVAL;
-		return 1;
+		return -1;
 	}
 
-	if (!stat(dir, &sb))
-		return 0;
+	if ( (fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC)) != -1 ) {
+		known_add(dir, strlen(dir));
+		return fd;
+	} else if (errno != ENOENT)
+		return -1;
+
+	if ( (len = strlen(dir)) >= sizeof(buf) ) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memcpy(buf, dir, len + 1);
 
-	/* TODO: fix the memory leak on strdup */
-	mkpath(dirname(strdup(dir)), mode);
+	while (len > 1 && buf[len-1] == '/')
+		buf[--len] = '\0';
 
-	return mkdir(dir, mode);
+retry:
+	/* deepest known ancestor, "/" if none */
+	for (base = len; base > 1; )
+	{
+		while (base > 1 && buf[base-1] != '/')
+			base--;
+		while (base > 1 && buf[base-1] == '/')
+			base--;
+		if (base > 1 && is_known(buf, base))
+			break;
+	}
+
+	if (base > 1) {
+		buf[base] = '\0';
+		afd = open(buf, O_PATH|O_DIRECTORY|O_CLOEXEC);
+		buf[base] = '/';
+
+		if (afd == -1) {
+			if (errno != ENOENT || retried)
+				return -1;
+			/* an ancestor went away underneath us */
+			mkpath_forget();
+			retried = 1;
+			goto retry;
+		}
+		pos = base + 1;
+	} else {
+		if ( (afd = open("/", O_PATH|O_DIRECTORY|O_CLOEXEC)) == -1 )
+			return -1;
+		pos = 1;
+	}
+
+	/*
+	 * buf + pos is now relative to afd: one mkdirat() per component and
+	 * the final open, chained so they can go to the backend in one batch
+	 */
+	rel = buf + (base > 1 ? base + 1 : 1);
+	for (n = 1, end = pos; end < len; end++)
+		if (buf[end] == '/' && buf[end + 1] != '/')
+			n++;
+
+	if ( !(ops = calloc(n + 1, sizeof(ioop_t))) ||
+			!(names = malloc(n * (len - pos + 2))) ) {
+		free(ops);
+		close(afd);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (k = 0, name = names; pos <= len; pos = end + 1)
+	{
+		for (end = pos; end < len && buf[end] != '/'; end++)
+			;
+		if (end == pos)
+			continue;
+
+		memcpy(name, rel, end - (rel - buf));
+		name[end - (rel - buf)] = '\0';
+		ops[k] = (ioop_t){ .op = IO_MKDIR, .chain = k > 0, .dfd = afd,
+			.path = name, .mode = end == len ? mode : 0755 };
+		name += end - (rel - buf) + 1;
+		k++;
+	}
+	ops[k] = (ioop_t){ .op = IO_OPEN, .chain = 1, .dfd = afd, .path = rel,
+		.flags = O_DIRECTORY|O_RDONLY|O_CLOEXEC };
+
+	io_submit(ops, k + 1);
+
+	fd = ops[k].res;
+	e = fd < 0 ? -fd : 0;
+	for (i = 0; i < k; i++)
+	{
+		if (ops[i].res == 0)
+			metrics_add(M_CREATED, 1);
+		else if (ops[i].res == -EEXIST)
+			;
+		else if (ops[i].res == -EACCES && !fstatat(afd, ops[i].path, &sb, 0) &&
+				S_ISDIR(sb.st_mode))
+			;
+		else {
+			e = -ops[i].res;
+			break;
+		}
+
+		known_add(buf, (rel - buf) + strlen(ops[i].path));
+	}
+
+	if (e && fd >= 0)
+		close(fd);
+
+	free(ops);
+	free(names);
+	close(afd);
+	errno = e;
+
+	return e ? -1 : fd;
 }
 
-/**
- * makepath - Create all components of the specified directory.
- * @dir: Directory to create.
+/*
+ * Create dir and every missing component leading up to it, then return a
+ * descriptor for it, so the caller can fchown()/fchmod() without another
+ * lookup.
+ *
+ * An existing dir costs a single open(). Otherwise the walk starts from
+ * the deepest ancestor known to exist and issues one mkdirat() per
+ * remaining component, relative to that ancestor, followed by the open of
+ * dir, as one chained batch; EEXIST just means the component was already
+ * there. Intermediate directories are created 0755,
+ * dir itself with mode (both subject to the umask).
  *
  * Returns:
- * POSIX OK (0) on success, otherwise -1 and errno set appropriately.
- * This function returns EINVAL on bad argument, or ENOMEM when it
- * fails allocating temporary memory.  For other error codes see the
- * mkdir() syscall description.
+ * an O_DIRECTORY descriptor on success, otherwise -1 with errno set.
  */
-int makepath(char *dir)
+int mkpath(const char *dir, mode_t mode)
 {
-	return mkpath(dir, 0777);
-}
+	int fd, e;
 
-/**
- * Local Variables:
- *  indent-tabs-mode: t
- *  c-file-style: "linux"
- * End:
- */
+	TRACE1(mkpath__start, dir);
+	fd = mkpath_at(dir, mode);
+	e = errno;
+	TRACE2(mkpath__done, dir, fd);
+	errno = e;
+
+	return fd;
+}
@@ -0,0 +1,349 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+#include "log.h"
+
+/*
+ * Run metrics for --stats=json and --metrics-textfile.
+ *
+ * Each thread notes the rule it executes with metrics_rule(), and the
+ * code below it counts against that rule's type and config file without
+ * knowing about either. Counting is a relaxed atomic add, and nothing
+ * is counted unless metrics_init() was called. Phases are only timed if
+ * asked for, the thread CPU clock is a syscall rather than a vDSO read.
+ */
+
+typedef struct mfile {
+	const char *name;
+	uint64_t c[M_NCOUNTERS];
+	struct mfile *next;
+} mfile_t;
+
+typedef struct mtype {
+	uint64_t c[M_NCOUNTERS];
+	bool seen;
+} mtype_t;
+
+static const char *const counter_names[M_NCOUNTERS] = {
+	"examined", "removed", "created", "bytes", "syscalls", "errors"
+};
+
+static const char *const counter_help[M_NCOUNTERS] = {
+	"Entries looked at",
+	"Entries removed",
+	"Entries created",
+	"Bytes reclaimed by removing entries",
+	"System calls issued for metadata and directory reads",
+	"Failed operations"
+};
+
+static const char *const phase_names[P_NPHASES] = {
+	"parse", "glob", "execute", "clean"
+};
+
+static bool enabled = false;
+static bool timed = false;
+static mtype_t types[256];
+static mfile_t *files = NULL;
+static uint64_t phase_ns[P_NPHASES][2];	/* wall, cpu */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread mtype_t *cur_type = NULL;
+static __thread mfile_t *cur_file = NULL;
+
+void metrics_init(bool phases)
+{
+	enabled = true;
+	timed = phases;
+}
+
+static mfile_t *file_get(const char *name)
+{
+	mfile_t *f;
+
+	pthread_mutex_lock(&lock);
+
+	/* rules of one file share its name */
+	for (f = files; f; f = f->next)
+		if (f->name == name || !strcmp(f->name, name))
+			break;
+
+	if (!f) {
+		if ( !(f = calloc(1, sizeof(mfile_t))) )
+			err(EXIT_FAILURE, "calloc");
+		f->name = name;
+		f->next = files;
+		files = f;
+	}
+
+	pthread_mutex_unlock(&lock);
+	return f;
+}
+
+/*
+ * Count what this thread does from now on against r, or against nothing
+ * if r is NULL.
+ */
+void metrics_rule(const rule_t *r)
+{
+	if (!enabled)
+		return;
+
+	if (!r) {
+		cur_type = NULL;
+		cur_file = NULL;
+		return;
+	}
+
+	cur_type = &types[(unsigned char)r->type];
+	cur_type->seen = true;
+	cur_file = r->file ? file_get(r->file) : NULL;
+}
+
+void metrics_add(int counter, uint64_t n)
+{
+	if (!enabled)
+		return;
+
+	if (cur_type)
+		__atomic_fetch_add(&cur_type->c[counter], n, __ATOMIC_RELAXED);
+	if (cur_file)
+		__atomic_fetch_add(&cur_file->c[counter], n, __ATOMIC_RELAXED);
+}
+
+/* the sum of counter over all rule types */
+uint64_t metrics_total(int counter)
+{
+	uint64_t n = 0;
+
+	for (int t = 0; t < 256; t++)
+		n += __atomic_load_n(&types[t].c[counter], __ATOMIC_RELAXED);
+
+	return n;
+}
+
+void metrics_begin(mphase_t *p)
+{
+	if (!timed)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &p->wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &p->cpu);
+}
+
+static uint64_t ns_since(const struct timespec *a, const struct timespec *b)
+{
+	return (uint64_t)(b->tv_sec - a->tv_sec) * 1000000000u +
+		b->tv_nsec - a->tv_nsec;
+}
+
+void metrics_end(int phase, const mphase_t *p)
+{
+	struct timespec wall, cpu;
+
+	if (!timed)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+
+	__atomic_fetch_add(&phase_ns[phase][0], ns_since(&p->wall, &wall),
+			__ATOMIC_RELAXED);
+	__atomic_fetch_add(&phase_ns[phase][1], ns_since(&p->cpu, &cpu),
+			__ATOMIC_RELAXED);
+}
+
+/* quote str as a JSON string */
+static void put_string(FILE *fp, const char *str)
+{
+	const unsigned char *s = (const unsigned char *)str;
+
+	fputc('"', fp);
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if (*s == '\n')
+			fputs("\\n", fp);
+		else if (*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+/*
+ * Quote str as a Prometheus label value. The text format knows no escapes
+ * but these three, any other byte goes in as it is.
+ */
+static void put_label(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; *str; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if (*str == '\n')
+			fputs("\\n", fp);
+		else
+			fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
+
+static void json_counters(FILE *fp, const uint64_t *c)
+{
+	for (int i = 0; i < M_NCOUNTERS; i++)
+		fprintf(fp, "%s\"%s\":%llu", i ? "," : "{", counter_names[i],
+				(unsigned long long)__atomic_load_n(&c[i], __ATOMIC_RELAXED));
+	fputc('}', fp);
+}
+
+void metrics_json(FILE *fp)
+{
+	const char *sep = "";
+	char name[2] = { 0, 0 };
+	mfile_t *f;
+
+	fputs("{\"types\":{", fp);
+	for (int t = 0; t < 256; t++)
+	{
+		if (!types[t].seen)
+			continue;
+		name[0] = t;
+		fputs(sep, fp);
+		put_string(fp, name);
+		fputc(':', fp);
+		json_counters(fp, types[t].c);
+		sep = ",";
+	}
+
+	fputs("},\"files\":{", fp);
+	pthread_mutex_lock(&lock);
+	for (sep = "", f = files; f; f = f->next, sep = ",")
+	{
+		fputs(sep, fp);
+		put_string(fp, f->name);
+		fputc(':', fp);
+		json_counters(fp, f->c);
+	}
+	pthread_mutex_unlock(&lock);
+
+	fputs("},\"phases\":{", fp);
+	for (int p = 0; p < P_NPHASES; p++)
+		fprintf(fp, "%s\"%s\":{\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f}",
+				p ? "," : "", phase_names[p], phase_ns[p][0] / 1e9,
+				phase_ns[p][1] / 1e9);
+	fputs("}}\n", fp);
+}
+
+static void prom_counters(FILE *fp)
+{
+	char name[2] = { 0, 0 };
+	mfile_t *f;
+
+	for (int i = 0; i < M_NCOUNTERS; i++)
+	{
+		fprintf(fp, "# HELP tmpfilesd_%s_total %s, by rule type.\n"
+				"# TYPE tmpfilesd_%s_total counter\n",
+				counter_names[i], counter_help[i], counter_names[i]);
+		for (int t = 0; t < 256; t++)
+		{
+			if (!types[t].seen)
+				continue;
+			name[0] = t;
+			fprintf(fp, "tmpfilesd_%s_total{type=", counter_names[i]);
+			put_label(fp, name);
+			fprintf(fp, "} %llu\n", (unsigned long long)
+					__atomic_load_n(&types[t].c[i], __ATOMIC_RELAXED));
+		}
+
+		fprintf(fp, "# HELP tmpfilesd_file_%s_total %s, by config file.\n"
+				"# TYPE tmpfilesd_file_%s_total counter\n",
+				counter_names[i], counter_help[i], counter_names[i]);
+		for (f = files; f; f = f->next)
+		{
+			fprintf(fp, "tmpfilesd_file_%s_total{file=", counter_names[i]);
+			put_label(fp, f->name);
+			fprintf(fp, "} %llu\n", (unsigned long long)
+					__atomic_load_n(&f->c[i], __ATOMIC_RELAXED));
+		}
+	}
+}
+
+/*
+ * Write the metrics in the Prometheus text format for node_exporter's
+ * textfile collector, which must never see a partial file.
+ */
+int metrics_textfile(const char *path)
+{
+	static const char *const kinds[2] = { "wall", "cpu" };
+	char *tmp;
+	size_t len;
+	FILE *fp;
+	int fd;
+
+	len = strlen(path) + sizeof(".XXXXXX");
+	if ( !(tmp = malloc(len)) ) {
+		log_warn("malloc");
+		return -1;
+	}
+	snprintf(tmp, len, "%s.XXXXXX", path);
+
+	if ( (fd = mkstemp(tmp)) == -1 || !(fp = fdopen(fd, "w")) ) {
+		log_warn("mkstemp(%s)", tmp);
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		return -1;
+	}
+
+	pthread_mutex_lock(&lock);
+	prom_counters(fp);
+	pthread_mutex_unlock(&lock);
+
+	for (int k = 0; k < 2; k++)
+	{
+		fprintf(fp, "# HELP tmpfilesd_phase_%s_seconds %s time spent per "
+				"phase, summed over threads.\n"
+				"# TYPE tmpfilesd_phase_%s_seconds counter\n",
+				kinds[k], k ? "CPU" : "Wall clock", kinds[k]);
+		for (int p = 0; p < P_NPHASES; p++)
+			fprintf(fp, "tmpfilesd_phase_%s_seconds{phase=\"%s\"} %.6f\n",
+					kinds[k], phase_names[p], phase_ns[p][k] / 1e9);
+	}
+
+	fprintf(fp, "# HELP tmpfilesd_last_run_timestamp_seconds When the "
+			"metrics were written.\n"
+			"# TYPE tmpfilesd_last_run_timestamp_seconds gauge\n"
+			"tmpfilesd_last_run_timestamp_seconds %lld\n",
+			(long long)time(NULL));
+
+	/* readable by node_exporter, which usually runs as another user */
+	if (fchmod(fd, 0644))
+		log_warn("fchmod(%s)", tmp);
+
+	if (fclose(fp) || rename(tmp, path)) {
+		log_warn("write(%s)", path);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	free(tmp);
+	return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "rule.h"
+
+/* counters, kept per rule type and per config file */
+#define M_EXAMINED	0	/* entries looked at */
+#define M_REMOVED	1
+#define M_CREATED	2
+#define M_BYTES		3	/* reclaimed by removing */
+#define M_SYSCALLS	4
+#define M_ERRORS	5
+#define M_NCOUNTERS	6
+
+/* phases, timed as the sum over every thread in them */
+#define P_PARSE		0
+#define P_GLOB		1
+#define P_EXECUTE	2
+#define P_CLEAN		3
+#define P_NPHASES	4
+
+typedef struct mphase {
+	struct timespec wall;
+	struct timespec cpu;
+} mphase_t;
+
+void metrics_init(bool phases);
+void metrics_rule(const rule_t *r);
+void metrics_add(int counter, uint64_t n);
+uint64_t metrics_total(int counter);
+void metrics_begin(mphase_t *p);
+void metrics_end(int phase, const mphase_t *p);
+void metrics_json(FILE *fp);
+int metrics_textfile(const char *path);
+
+#endif
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "rmtree.h"
+#include "dirstream.h"
+#include "iobackend.h"
+#include "budget.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
+
+/*
+ * Tree removal without recursion.
+ *
+ * Directories are walked depth first with an explicit stack holding one
+ * open directory and a small getdents64() buffer per level, so memory and
+ * open fds grow with the depth of the tree, never with its width. Entries
+ * are removed with unlinkat() as they are read: d_type tells directories
+ * apart, and for DT_UNKNOWN an EISDIR from unlinkat() does. Entries known
+ * not to be directories are handed to the I/O backend RM_BATCH at a time. A directory
+ * is removed with AT_REMOVEDIR once its stack frame is done. Mount points
+ * below the top directory are left alone.
+ *
+ * Only the RM_MAXFDS innermost levels keep their directory open. Outer
+ * ones are closed with their read position saved, and reopened through
+ * ".." of their child when the walk returns to them, checking that they
+ * are still the same directory, to carry on reading where they stopped.
+ * Reading them again from the start would find whatever could not be
+ * removed below them, and walk down to it all over again.
+ *
+ * With RM_BUDGET every entry read takes a token from the budget. Once it
+ * runs out the walk stops, leaving the rest of the tree in place. Other
+ * removals, like replacing a node for a '+' type, always finish.
+ */
+
+#define RM_BUFSZ	(8 * 1024)
+#define RM_MAXFDS	128
+#define RM_BATCH	64
+
+typedef struct rmframe {
+	dstream_t ds;
+	ino_t ino;
+	off_t pos;			/* of ds while its fd is closed */
+	char name[NAME_MAX + 1];	/* of this directory in its parent */
+} rmframe_t;
+
+typedef struct rmbatch {
+	size_t n;
+	ioop_t ops[RM_BATCH];
+	char names[RM_BATCH][NAME_MAX + 1];
+} rmbatch_t;
+
+static int rm_flush(rmbatch_t *b, const char *path)
+{
+	int ret = 0;
+
+	io_submit(b->ops, b->n);
+
+	for (size_t i = 0; i < b->n; i++)
+		if (!b->ops[i].res)
+			metrics_add(M_REMOVED, 1);
+		else if ( (errno = -b->ops[i].res) != ENOENT ) {
+			log_warn("unlink(%s: %s)", path, b->ops[i].path);
+			metrics_add(M_ERRORS, 1);
+			ret = -1;
+		}
+
+	b->n = 0;
+	return ret;
+}
+
+/* close the directory of frame p, to be reopened by rm_reopen() */
+static void rm_park(rmframe_t *p)
+{
+	if ( (p->pos = lseek(p->ds.fd, 0, SEEK_CUR)) == -1 )
+		return;
+
+	close(p->ds.fd);
+	p->ds.fd = -1;
+}
+
+/* reopen the closed frame p from its child directory cfd */
+static int rm_reopen(rmframe_t *p, int cfd, dev_t dev, const char *path)
+{
+	struct stat sb;
+	int fd;
+
+	if ( (fd = openat(cfd, "..", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1 ) {
+		log_warn("open(%s: ..)", path);
+		return -1;
+	}
+
+	if (fstat(fd, &sb) == -1 || sb.st_dev != dev || sb.st_ino != p->ino) {
+		log_warnx("%s: directory moved during removal", path);
+		close(fd);
+		return -1;
+	}
+
+	if (lseek(fd, p->pos, SEEK_SET) == -1) {
+		log_warn("lseek(%s: ..)", path);
+		close(fd);
+		return -1;
+	}
+
+	p->ds.fd = fd;
+	return 0;
+}
+
+static int rm_one(int dfd, const char *name, const char *path, bool dir)
+{
+	if (!unlinkat(dfd, name, dir ? AT_REMOVEDIR : 0)) {
+		metrics_add(M_REMOVED, 1);
+		return 0;
+	}
+
+	if (errno == ENOENT)
+		return 0;
+
+	/* left behind by mount points or by r on a populated directory */
+	if (dir && (errno == ENOTEMPTY || errno == EEXIST || errno == EBUSY))
+		return 0;
+
+	log_warn("%s(%s%s%s)", dir ? "rmdir" : "unlink", path,
+			strcmp(name, path) ? ": " : "", strcmp(name, path) ? name : "");
+	metrics_add(M_ERRORS, 1);
+	return -1;
+}
+
+static int rm_walk(int dfd, const char *name, const char *path,
+		unsigned flags)
+{
+	rmframe_t *stack = NULL, *f;
+	rmbatch_t *b;
+	size_t depth = 0, size = 0;
+	struct stat sb;
+	dsent_t ent;
+	dev_t dev;
+	int fd, rc, ret = 0;
+
+	if ( !(flags & RM_CONTENTS) && !unlinkat(dfd, name, 0) ) {
+		metrics_add(M_REMOVED, 1);
+		return 0;
+	}
+
+	if ( !(flags & RM_CONTENTS) && errno != EISDIR && errno != EPERM ) {
+		if (errno == ENOENT)
+			return 0;
+		log_warn("unlink(%s)", path);
+		metrics_add(M_ERRORS, 1);
+		return -1;
+	}
+
+	if ( !(flags & RM_RECURSE) )
+		return (flags & RM_CONTENTS) ? 0 : rm_one(dfd, name, path, true);
+
+	if ( (fd = openat(dfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC))
+			== -1 ) {
+		if (errno == ENOENT || (errno == ENOTDIR && (flags & RM_CONTENTS)))
+			return 0;
+		log_warn("open(%s)", path);
+		metrics_add(M_ERRORS, 1);
+		return -1;
+	}
+
+	if (fstat(fd, &sb) == -1) {
+		log_warn("stat(%s)", path);
+		close(fd);
+		return -1;
+	}
+	dev = sb.st_dev;
+
+	if ( !(b = malloc(sizeof(rmbatch_t))) ) {
+		log_warn("malloc");
+		close(fd);
+		return -1;
+	}
+	b->n = 0;
+
+	do {
+		if (b->n)
+			ret |= rm_flush(b, path);
+
+		if (depth == size) {
+			size = size ? size * 2 : 16;
+			if ( !(f = realloc(stack, size * sizeof(rmframe_t))) ) {
+				log_warn("realloc");
+				close(fd);
+				ret = -1;
+				break;
+			}
+			stack = f;
+		}
+
+		f = &stack[depth];
+		f->ino = sb.st_ino;
+		f->name[0] = '\0';
+		if (depth)
+			strcpy(f->name, ent.name);
+		if (ds_open(&f->ds, fd, RM_BUFSZ)) {
+			log_warn("malloc");
+			ret = -1;
+			break;
+		}
+		if (depth >= RM_MAXFDS)
+			rm_park(&stack[depth - RM_MAXFDS]);
+		depth++;
+		fd = -1;
+
+		while (depth && fd == -1)
+		{
+			f = &stack[depth - 1];
+
+			if ((flags & RM_BUDGET) && budget_take(1)) {
+				ret = -1;
+				break;
+			}
+
+			if ( (rc = ds_next(&f->ds, &ent)) == 1 ) {
+				metrics_add(M_EXAMINED, 1);
+
+				if (ent.type != DT_DIR && ent.type != DT_UNKNOWN) {
+					strcpy(b->names[b->n], ent.name);
+					b->ops[b->n] = (ioop_t){ .op = IO_UNLINK, .dfd = f->ds.fd,
+						.path = b->names[b->n] };
+					if (++b->n == RM_BATCH)
+						ret |= rm_flush(b, path);
+					continue;
+				}
+
+				if (ent.type == DT_UNKNOWN) {
+					if (!unlinkat(f->ds.fd, ent.name, 0)) {
+						metrics_add(M_REMOVED, 1);
+						continue;
+					}
+					if (errno == ENOENT)
+						continue;
+					if (errno != EISDIR) {
+						log_warn("unlink(%s: %s)", path, ent.name);
+						metrics_add(M_ERRORS, 1);
+						ret = -1;
+						continue;
+					}
+				}
+
+				if ( (fd = openat(f->ds.fd, ent.name,
+								O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC))
+						== -1 ) {
+					if (errno == ENOTDIR)
+						ret |= rm_one(f->ds.fd, ent.name, path, false);
+					else if (errno != ENOENT) {
+						log_warn("open(%s: %s)", path, ent.name);
+						metrics_add(M_ERRORS, 1);
+						ret = -1;
+					}
+					continue;
+				}
+
+				if (fstat(fd, &sb) == -1 || sb.st_dev != dev) {
+					close(fd);
+					fd = -1;
+				}
+				continue;
+			}
+
+			if (rc == -1) {
+				log_warn("getdents(%s)", path);
+				metrics_add(M_ERRORS, 1);
+				ret = -1;
+			}
+
+			if (b->n)
+				ret |= rm_flush(b, path);
+
+			depth--;
+
+			if (depth && stack[depth - 1].ds.fd == -1 &&
+					rm_reopen(&stack[depth - 1], f->ds.fd, dev, path)) {
+				ds_close(&f->ds);
+				ret = -1;
+				break;
+			}
+
+			ds_close(&f->ds);
+
+			if (depth)
+				ret |= rm_one(stack[depth - 1].ds.fd, f->name, path, true);
+			else if ( !(flags & RM_CONTENTS) )
+				ret |= rm_one(dfd, name, path, true);
+		}
+	} while (fd != -1);
+
+	while (depth)
+		ds_close(&stack[--depth].ds);
+	free(stack);
+	free(b);
+
+	return ret ? -1 : 0;
+}
+
+/*
+ * Remove name relative to dfd, path is only used for messages. Without
+ * RM_RECURSE a directory is only removed if it is empty.
+ */
+int rm_tree(int dfd, const char *name, const char *path, unsigned flags)
+{
+	int ret;
+
+	TRACE2(rm__start, path, flags);
+	ret = rm_walk(dfd, name, path, flags);
+	TRACE2(rm__done, path, ret);
+
+	return ret;
+}
@@ -0,0 +1,10 @@
+#ifndef _RMTREE_H
+#define _RMTREE_H
+
+#define RM_RECURSE	0x01	/* remove directories along with their contents */
+#define RM_CONTENTS	0x02	/* empty the directory, but keep it */
+#define RM_BUDGET	0x04	/* stop once the cleaning budget runs out */
+
+int rm_tree(int dfd, const char *name, const char *path, unsigned flags);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef _RULE_H
+#define _RULE_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#define	CREAT_FILE	0x00
+#define TRUNC_FILE	0x01
+#define WRITE_ARG	0x02
+#define MKDIR		0x04
+#define MKDIR_RMF	0x05
+#define CREATE_SVOL	0x06
+#define CREATE_PIPE	0x08
+#define CREATE_SYM	0x0A
+#define	CREATE_CHAR	0x0C
+#define CREATE_BLK	0x0E
+#define	COPY		0x10
+#define	IGN			0x12
+#define	IGNR		0x13
+#define	RM			0x14
+#define	RMRF		0x15
+#define	CHMOD		0x16
+#define	CHMODR		0x17
+#define	CHATTR		0x18
+#define	CHATTRR		0x19
+#define	ACL			0x20
+#define	ACLR		0x21
+
+#define MAX_TYPE	0x21
+
+/* rule_t.flags */
+#define RF_BOOT		0x01	/* only run with --boot ('!') */
+#define RF_DEFMODE	0x02	/* mode omitted or '-' */
+#define RF_MASK		0x04	/* mode prefixed with '~' */
+#define RF_DEFUID	0x08	/* user omitted or '-' */
+#define RF_DEFGID	0x10	/* group omitted or '-' */
+#define RF_AGE		0x20	/* age is set */
+#define RF_SUBONLY	0x40	/* age prefixed with '~' */
+
+struct tmpl;
+
+/*
+ * A parsed and validated line from a tmpfiles.d config. path and arg are
+ * kept as written, tpath and targ are their compiled templates and xpath
+ * is the expanded path without root. Only the first two are part of the
+ * rule cache.
+ */
+typedef struct rule {
+	const char *path;
+	const char *arg;
+	const struct tmpl *tpath;
+	const struct tmpl *targ;
+	const char *xpath;
+	const char *file;
+	unsigned line;
+	unsigned flags;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	struct timeval age;
+	char type;
+	char suff;
+	unsigned char act;
+} rule_t;
+
+#endif
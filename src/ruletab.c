@@ -0,0 +1,178 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+
+#include "ruletab.h"
+#include "spec.h"
+#include "arena.h"
+#include "log.h"
+
+/*
+ * Rule table keyed by expanded path and action class.
+ *
+ * Rules are added in config order, that is by file precedence and then
+ * line. As with systemd-tmpfiles the first rule for a path wins and later
+ * rules of the same class for that path are dropped with a warning, so
+ * the executor touches each path once per class. A '+' suffix plays no
+ * part in this, it only asks for the node to be replaced. An exact repeat
+ * of an earlier line is dropped silently.
+ */
+
+enum {
+	RC_CREATE,	/* f F d D v p L c b C */
+	RC_WRITE,	/* w */
+	RC_IGNORE,	/* x X */
+	RC_REMOVE,	/* r R */
+	RC_MODE,	/* z Z */
+	RC_XATTR,	/* t T */
+	RC_ACL		/* a A */
+};
+
+typedef struct slot {
+	const rule_t *rule;
+	size_t hash;
+} slot_t;
+
+static slot_t *slots = NULL;
+static size_t nslots = 0, nused = 0;
+static rule_t **order = NULL;
+static size_t norder = 0, order_size = 0;
+
+static int rule_class(const rule_t *r)
+{
+	switch (r->act)
+	{
+		case WRITE_ARG:	return RC_WRITE;
+		case IGN:
+		case IGNR:		return RC_IGNORE;
+		case RM:
+		case RMRF:		return RC_REMOVE;
+		case CHMOD:
+		case CHMODR:	return RC_MODE;
+		case CHATTR:
+		case CHATTRR:	return RC_XATTR;
+		case ACL:
+		case ACLR:		return RC_ACL;
+		default:		return RC_CREATE;
+	}
+}
+
+static size_t rule_hash(const char *path, int class)
+{
+	size_t h = 2166136261u;
+
+	while (*path)
+		h = (h ^ (unsigned char)*path++) * 16777619u;
+
+	return (h ^ class) * 16777619u;
+}
+
+static bool same_key(const rule_t *a, const rule_t *b)
+{
+	return rule_class(a) == rule_class(b) && !strcmp(a->xpath, b->xpath);
+}
+
+static bool same_line(const rule_t *a, const rule_t *b)
+{
+	return a->act == b->act && a->suff == b->suff && a->flags == b->flags &&
+		a->mode == b->mode && a->uid == b->uid && a->gid == b->gid &&
+		a->age.tv_sec == b->age.tv_sec && a->age.tv_usec == b->age.tv_usec &&
+		(a->arg == b->arg || (a->arg && b->arg && !strcmp(a->arg, b->arg)));
+}
+
+static void grow(void)
+{
+	slot_t *old = slots;
+	size_t i, j, oldsize = nslots;
+
+	nslots = nslots ? nslots * 2 : 1024;
+	if ( !(slots = calloc(nslots, sizeof(slot_t))) )
+		err(1, "calloc");
+
+	for (i = 0; i < oldsize; i++) {
+		if (!old[i].rule)
+			continue;
+		for (j = old[i].hash & (nslots - 1); slots[j].rule;
+				j = (j + 1) & (nslots - 1))
+			;
+		slots[j] = old[i];
+	}
+
+	free(old);
+}
+
+/*
+ * Expand the path of r and add it to the table. Returns 0 if the rule was
+ * added, -1 if it was dropped.
+ */
+int ruletab_add(rule_t *r)
+{
+	const tmpl_t *t = r->tpath;
+	rule_t **tmp;
+	size_t h, i;
+	char *xpath;
+
+	if (!t)
+		return -1;
+
+	xpath = arena_alloc(t->len + 1);
+	tmpl_expand(t, xpath, t->len + 1);
+	r->xpath = xpath;
+
+	if ( (nused + 1) * 2 > nslots )
+		grow();
+
+	h = rule_hash(xpath, rule_class(r));
+
+	for (i = h & (nslots - 1); slots[i].rule; i = (i + 1) & (nslots - 1))
+	{
+		if (slots[i].hash != h || !same_key(slots[i].rule, r))
+			continue;
+
+		if (same_line(slots[i].rule, r))
+			return -1;
+
+		log_msg(LV_WARN, "%s:%u: duplicate line for path \"%s\", ignoring",
+				r->file, r->line, xpath);
+		return -1;
+	}
+
+	slots[i].rule = r;
+	slots[i].hash = h;
+	nused++;
+
+	if (norder == order_size) {
+		order_size = order_size ? order_size * 2 : 256;
+		if ( !(tmp = realloc(order, sizeof(rule_t *) * order_size)) )
+			err(1, "realloc");
+		order = tmp;
+	}
+	order[norder++] = r;
+
+	return 0;
+}
+
+/*
+ * The surviving rules, in the order they were added.
+ */
+rule_t **ruletab_rules(size_t *count)
+{
+	*count = norder;
+	return order;
+}
+
+/*
+ * Empty the table, e.g. before the configs are loaded again.
+ */
+void ruletab_reset(void)
+{
+	free(slots);
+	free(order);
+	slots = NULL;
+	order = NULL;
+	nslots = nused = 0;
+	norder = order_size = 0;
+}
@@ -0,0 +1,10 @@
+#ifndef _RULETAB_H
+#define _RULETAB_H
+
+#include "rule.h"
+
+int ruletab_add(rule_t *r);
+rule_t **ruletab_rules(size_t *count);
+void ruletab_reset(void);
+
+#endif
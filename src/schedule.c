@@ -0,0 +1,112 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <err.h>
+
+#include "schedule.h"
+
+static bool before(const sched_ent_t *a, const sched_ent_t *b)
+{
+	return a->due.tv_sec < b->due.tv_sec ||
+		(a->due.tv_sec == b->due.tv_sec && a->due.tv_nsec < b->due.tv_nsec);
+}
+
+static void place(sched_t *s, sched_ent_t *e, size_t pos)
+{
+	s->heap[pos] = e;
+	e->pos = pos;
+}
+
+static void sift_up(sched_t *s, size_t pos)
+{
+	sched_ent_t *e = s->heap[pos];
+	size_t parent;
+
+	while (pos)
+	{
+		parent = (pos - 1) / 2;
+		if ( !before(e, s->heap[parent]) )
+			break;
+		place(s, s->heap[parent], pos);
+		pos = parent;
+	}
+
+	place(s, e, pos);
+}
+
+static void sift_down(sched_t *s, size_t pos)
+{
+	sched_ent_t *e = s->heap[pos];
+	size_t child;
+
+	while ( (child = 2 * pos + 1) < s->len )
+	{
+		if (child + 1 < s->len && before(s->heap[child + 1], s->heap[child]))
+			child++;
+		if ( !before(s->heap[child], e) )
+			break;
+		place(s, s->heap[child], pos);
+		pos = child;
+	}
+
+	place(s, e, pos);
+}
+
+/*
+ * Schedule e at due, or move it there if it already is scheduled.
+ */
+void sched_set(sched_t *s, sched_ent_t *e, const struct timespec *due)
+{
+	sched_ent_t **tmp;
+
+	if (e->pos == SCHED_NONE) {
+		if (s->len == s->size) {
+			s->size = s->size ? s->size * 2 : 16;
+			if ( !(tmp = realloc(s->heap, s->size * sizeof(*tmp))) )
+				err(EXIT_FAILURE, "realloc");
+			s->heap = tmp;
+		}
+		e->due = *due;
+		place(s, e, s->len++);
+		sift_up(s, e->pos);
+		return;
+	}
+
+	e->due = *due;
+	sift_up(s, e->pos);
+	sift_down(s, e->pos);
+}
+
+void sched_remove(sched_t *s, sched_ent_t *e)
+{
+	size_t pos = e->pos;
+	sched_ent_t *last;
+
+	if (pos == SCHED_NONE)
+		return;
+
+	e->pos = SCHED_NONE;
+	if (pos == --s->len)
+		return;
+
+	last = s->heap[s->len];
+	place(s, last, pos);
+	sift_up(s, pos);
+	sift_down(s, last->pos);
+}
+
+/* the entry due first, NULL if none is scheduled */
+sched_ent_t *sched_first(const sched_t *s)
+{
+	return s->len ? s->heap[0] : NULL;
+}
+
+void sched_free(sched_t *s)
+{
+	for (size_t i = 0; i < s->len; i++)
+		s->heap[i]->pos = SCHED_NONE;
+	free(s->heap);
+	s->heap = NULL;
+	s->len = s->size = 0;
+}
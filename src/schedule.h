@@ -0,0 +1,29 @@
+#ifndef _SCHEDULE_H
+#define _SCHEDULE_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define SCHED_NONE	((size_t)-1)
+
+/*
+ * Min-heap of due times. An entry is embedded in the caller's own object
+ * and knows its heap position, so it can be moved or removed in place.
+ */
+typedef struct sched_ent {
+	struct timespec due;
+	size_t pos;			/* SCHED_NONE when not scheduled */
+} sched_ent_t;
+
+typedef struct sched {
+	sched_ent_t **heap;
+	size_t len;
+	size_t size;
+} sched_t;
+
+void sched_set(sched_t *s, sched_ent_t *e, const struct timespec *due);
+void sched_remove(sched_t *s, sched_ent_t *e);
+sched_ent_t *sched_first(const sched_t *s);
+void sched_free(sched_t *s);
+
+#endif
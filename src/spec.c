@@ -0,0 +1,260 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/utsname.h>
+
+#include "spec.h"
+#include "arena.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * Specifier table. Every supported specifier is resolved once by
+ * spec_init(), tmpl_compile() then only has to look values up.
+ *
+ * %b - Boot ID
+ * %B - Operating system build ID (BUILD_ID= in os-release)
+ * %C - System cache directory (/var/cache)
+ * %g - Group name of the running user
+ * %G - Group ID of the running user
+ * %h - Home directory of the running user
+ * %H - Host name
+ * %l - Short host name (up to the first dot)
+ * %L - System log directory (/var/log)
+ * %m - Machine ID (machine-id(5))
+ * %o - Operating system ID (ID= in os-release)
+ * %S - System state directory (/var/lib)
+ * %t - System runtime directory (/run)
+ * %T - Temporary directory ($TMPDIR or /tmp)
+ * %u - Name of the running user
+ * %U - User ID of the running user
+ * %v - Kernel release (uname -r)
+ * %V - Temporary directory for larger files ($TMPDIR or /var/tmp)
+ * %w - Operating system version ID (VERSION_ID= in os-release)
+ * %W - Operating system variant ID (VARIANT_ID= in os-release)
+ * %% - %
+ */
+
+#define NSPEC 128
+#define SPEC_CHARS "bBCgGhHlLmoStTuUvVwW%"
+
+static const char *spec_tab[NSPEC];
+
+static char *read_id(const char *file)
+{
+	char buf[64], *ret, *dst;
+	const char *src;
+	FILE *fp;
+
+	if ( !(fp = fopen(file, "r")) )
+		return NULL;
+
+	if ( !fgets(buf, sizeof(buf), fp) ) {
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+
+	/* formatted without dashes, as systemd does */
+	ret = dst = arena_alloc(sizeof(buf));
+	for (src = buf; *src && !isspace((unsigned char)*src); src++)
+		if (*src != '-')
+			*dst++ = *src;
+	*dst = '\0';
+
+	return *ret ? ret : NULL;
+}
+
+static void read_os_release(const char *root)
+{
+	static const struct { const char *key; char spec; } keys[] = {
+		{ "BUILD_ID",	'B' },
+		{ "ID",			'o' },
+		{ "VERSION_ID",	'w' },
+		{ "VARIANT_ID",	'W' },
+		{ NULL, 0 }
+	};
+	char path[PATH_MAX], *line = NULL, *val, *end;
+	size_t ign = 0, len;
+	FILE *fp = NULL;
+	int i;
+
+	if (pathcpy(path, sizeof(path), root, "/etc/os-release"))
+		fp = fopen(path, "r");
+	if (!fp && pathcpy(path, sizeof(path), root, "/usr/lib/os-release"))
+		fp = fopen(path, "r");
+	if (!fp)
+		return;
+
+	while (getline(&line, &ign, fp) != -1)
+	{
+		trim(line);
+
+		if ( !(val = strchr(line, '=')) )
+			continue;
+		*val++ = '\0';
+
+		len = strlen(val);
+		if (len >= 2 && (*val == '"' || *val == '\'') && val[len-1] == *val) {
+			end = val + len - 1;
+			*end = '\0';
+			val++;
+		}
+
+		for (i = 0; keys[i].key; i++)
+			if (!strcmp(line, keys[i].key))
+				spec_tab[(int)keys[i].spec] = arena_strdup(val);
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+static const char *fmt_id(unsigned long id)
+{
+	char buf[24];
+
+	snprintf(buf, sizeof(buf), "%lu", id);
+	return arena_strdup(buf);
+}
+
+void spec_init(const char *root)
+{
+	char host[HOST_NAME_MAX + 1], path[PATH_MAX], *dot;
+	struct utsname un;
+	struct passwd *pw;
+	struct group *gr;
+	const char *tmp;
+
+	spec_tab['%'] = "%";
+
+	spec_tab['b'] = read_id("/proc/sys/kernel/random/boot_id");
+	if (pathcpy(path, sizeof(path), root, "/etc/machine-id"))
+		spec_tab['m'] = read_id(path);
+
+	if (!gethostname(host, sizeof(host))) {
+		host[HOST_NAME_MAX] = '\0';
+		spec_tab['H'] = arena_strdup(host);
+		if ( (dot = strchr(host, '.')) )
+			*dot = '\0';
+		spec_tab['l'] = arena_strdup(host);
+	} else
+		log_warn("gethostname");
+
+	if (!uname(&un))
+		spec_tab['v'] = arena_strdup(un.release);
+	else
+		log_warn("uname");
+
+	read_os_release(root);
+
+	tmp = getenv("TMPDIR");
+	spec_tab['T'] = (tmp && *tmp == '/') ? tmp : "/tmp";
+	spec_tab['V'] = (tmp && *tmp == '/') ? tmp : "/var/tmp";
+	spec_tab['t'] = "/run";
+	spec_tab['S'] = "/var/lib";
+	spec_tab['C'] = "/var/cache";
+	spec_tab['L'] = "/var/log";
+
+	spec_tab['U'] = fmt_id(getuid());
+	spec_tab['G'] = fmt_id(getgid());
+
+	if ( (pw = getpwuid(getuid())) ) {
+		spec_tab['u'] = arena_strdup(pw->pw_name);
+		spec_tab['h'] = arena_strdup(pw->pw_dir);
+	}
+
+	if ( (gr = getgrgid(getgid())) )
+		spec_tab['g'] = arena_strdup(gr->gr_name);
+}
+
+/*
+ * Split str into literal and specifier segments. Returns NULL if str uses
+ * an unknown specifier or one that could not be resolved.
+ */
+const tmpl_t *tmpl_compile(const char *str)
+{
+	const char *p, *lit;
+	size_t nseg = 1;
+	tmpl_t *t;
+	int c;
+
+	if (!str)
+		return NULL;
+
+	for (p = str; *p; p++)
+		if (*p == '%')
+			nseg += 2;
+
+	t = arena_alloc(sizeof(tmpl_t) + nseg * sizeof(tseg_t));
+	t->nseg = 0;
+	t->len = 0;
+
+	for (p = lit = str; *p; p++)
+	{
+		if (*p != '%')
+			continue;
+
+		if (p > lit) {
+			t->seg[t->nseg].str = lit;
+			t->seg[t->nseg].len = p - lit;
+			t->len += p - lit;
+			t->nseg++;
+		}
+
+		c = (unsigned char)*++p;
+
+		if (!c) {
+			log_warnx("%s: trailing %%", str);
+			return NULL;
+		} else if (c >= NSPEC || !spec_tab[c]) {
+			log_warnx("%s: %s specifier %%%c", str,
+					strchr(SPEC_CHARS, c) ? "unresolved" : "unknown", c);
+			return NULL;
+		}
+
+		t->seg[t->nseg].str = spec_tab[c];
+		t->seg[t->nseg].len = strlen(spec_tab[c]);
+		t->len += t->seg[t->nseg].len;
+		t->nseg++;
+
+		lit = p + 1;
+	}
+
+	if (p > lit) {
+		t->seg[t->nseg].str = lit;
+		t->seg[t->nseg].len = p - lit;
+		t->len += p - lit;
+		t->nseg++;
+	}
+
+	return t;
+}
+
+/*
+ * Expand t into buf. Returns NULL if buf is too small.
+ */
+char *tmpl_expand(const tmpl_t *t, char *buf, size_t size)
+{
+	char *dst = buf;
+	size_t i;
+
+	if (!t || t->len >= size)
+		return NULL;
+
+	for (i = 0; i < t->nseg; i++) {
+		memcpy(dst, t->seg[i].str, t->seg[i].len);
+		dst += t->seg[i].len;
+	}
+	*dst = '\0';
+
+	return buf;
+}
@@ -0,0 +1,25 @@
+#ifndef _SPEC_H
+#define _SPEC_H
+
+#include <stddef.h>
+
+/*
+ * A path or argument split into literal and specifier segments. Specifier
+ * values are fixed for the run, so the expanded length is known up front.
+ */
+typedef struct tseg {
+	const char *str;
+	size_t len;
+} tseg_t;
+
+typedef struct tmpl {
+	size_t nseg;
+	size_t len;
+	tseg_t seg[];
+} tmpl_t;
+
+void spec_init(const char *root);
+const tmpl_t *tmpl_compile(const char *str);
+char *tmpl_expand(const tmpl_t *t, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,491 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "state.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * Scan state kept between runs for the age based cleanup.
+ *
+ * Every directory clean_path() fully scanned gets a record of its inode,
+ * its ctime after the scan and the oldest timestamp left below it. While
+ * the former two still match, the whole subtree is skipped until the
+ * oldest timestamp reaches the age. A directory is only recorded once
+ * everything below it is, so a run that is cut short resumes with the
+ * subtrees it had not finished yet.
+ *
+ * Only the top of a skipped subtree is checked. That is enough for files:
+ * a file counts its ctime, which is the current time whenever one is
+ * created, moved or has its times set, so nothing below can turn up older
+ * than the record. Directories do not count their ctime, as removing an
+ * entry changes it, so an old directory moved in from elsewhere, or one
+ * whose times were set back, is not noticed unless it is right in the top
+ * directory. It is only removed once the top changes or its record comes
+ * due; skipping can delay a cleanup like that, never cause one.
+ *
+ * The file is a header, the records sorted by path and a string table,
+ * written to a temporary file and renamed over the old one. The key holds
+ * the rules it was made for; other rules, such as a new x line, make the
+ * records worthless.
+ */
+
+#define STATE_MAGIC		"TMPFDS\0"
+#define STATE_VERSION	2
+#define STATE_INTERVAL	30	/* seconds between checkpoints */
+
+struct state_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t key;
+	uint32_t nrecs;
+	uint32_t strsz;
+};
+
+struct state_rec {
+	uint64_t ino;
+	int64_t ctime_sec;
+	int64_t oldest_sec;
+	uint32_t ctime_nsec;
+	uint32_t oldest_nsec;
+	uint32_t path;
+	uint32_t pad;
+};
+
+typedef struct srec {
+	char *path;
+	dstate_t st;
+	bool seen;		/* looked up since the last save */
+	bool fresh;		/* rescanned since the last save */
+	bool gone;		/* removed since */
+	bool drop;
+} srec_t;
+
+static char *state_path = NULL;
+static char *state_keystr = NULL;
+static srec_t **slots = NULL;
+static size_t nslots = 0, nused = 0;
+static time_t last_save;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash(const char *str)
+{
+	uint32_t h = 2166136261u;
+
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619u;
+
+	return h;
+}
+
+static srec_t **find(const char *path)
+{
+	size_t i = hash(path) & (nslots - 1);
+
+	while (slots[i] && strcmp(slots[i]->path, path))
+		i = (i + 1) & (nslots - 1);
+
+	return &slots[i];
+}
+
+static void grow(void)
+{
+	srec_t **old = slots;
+	size_t i, n = nslots;
+
+	nslots = nslots ? nslots * 2 : 256;
+	if ( !(slots = calloc(nslots, sizeof(srec_t *))) )
+		err(EXIT_FAILURE, "calloc");
+
+	for (i = 0; i < n; i++)
+		if (old[i])
+			*find(old[i]->path) = old[i];
+
+	free(old);
+}
+
+static srec_t *insert(const char *path)
+{
+	srec_t **slot;
+
+	if ( (nused + 1) * 4 > nslots * 3 )
+		grow();
+
+	if ( *(slot = find(path)) )
+		return *slot;
+
+	if ( !(*slot = calloc(1, sizeof(srec_t))) || !((*slot)->path = strdup(path)) )
+		err(EXIT_FAILURE, "calloc");
+	nused++;
+
+	return *slot;
+}
+
+static void clear(void)
+{
+	for (size_t i = 0; i < nslots; i++) {
+		if (!slots[i])
+			continue;
+		free(slots[i]->path);
+		free(slots[i]);
+		slots[i] = NULL;
+	}
+	nused = 0;
+}
+
+static time_t uptime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void load(void)
+{
+	const struct state_hdr *hdr;
+	const struct state_rec *rec;
+	const char *strs;
+	struct stat sb;
+	char *buf = NULL;
+	srec_t *r;
+	size_t need;
+	ssize_t rc;
+	off_t off = 0;
+	uint32_t i;
+	int fd;
+
+	if ( (fd = open(state_path, O_RDONLY|O_CLOEXEC)) == -1 ) {
+		if (errno != ENOENT)
+			log_warn("open(%s)", state_path);
+		return;
+	}
+
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(*hdr) ||
+			!(buf = malloc(sb.st_size)))
+		goto done;
+
+	while (off < sb.st_size)
+	{
+		if ( (rc = read(fd, buf + off, sb.st_size - off)) <= 0 ) {
+			if (rc == -1 && errno == EINTR)
+				continue;
+			goto done;
+		}
+		off += rc;
+	}
+
+	hdr = (const struct state_hdr *)buf;
+	if (memcmp(hdr->magic, STATE_MAGIC, sizeof(hdr->magic)) ||
+			hdr->version != STATE_VERSION)
+		goto done;
+
+	need = sizeof(*hdr) + (size_t)hdr->nrecs * sizeof(*rec) + hdr->strsz;
+	if (need != (size_t)sb.st_size || !hdr->strsz ||
+			buf[sb.st_size - 1] != '\0' || hdr->key >= hdr->strsz)
+		goto done;
+
+	rec = (const struct state_rec *)(hdr + 1);
+	strs = (const char *)(rec + hdr->nrecs);
+
+	if ( !(state_keystr = strdup(strs + hdr->key)) )
+		err(EXIT_FAILURE, "strdup");
+
+	for (i = 0; i < hdr->nrecs; i++, rec++)
+	{
+		if (rec->path >= hdr->strsz)
+			continue;
+		r = insert(strs + rec->path);
+		r->st.ino = rec->ino;
+		r->st.ctime_sec = rec->ctime_sec;
+		r->st.ctime_nsec = rec->ctime_nsec;
+		r->st.oldest_sec = rec->oldest_sec;
+		r->st.oldest_nsec = rec->oldest_nsec;
+	}
+
+done:
+	free(buf);
+	close(fd);
+}
+
+/*
+ * Keep the scan state in path, and load what is already there.
+ */
+void state_init(const char *path)
+{
+	if ( !(state_path = strdup(path)) )
+		err(EXIT_FAILURE, "strdup");
+
+	last_save = uptime();
+	load();
+}
+
+/*
+ * Name the rules the state is for. Records made for other rules are
+ * dropped.
+ */
+void state_key(const char *key)
+{
+	pthread_mutex_lock(&lock);
+
+	if ( !state_keystr || strcmp(state_keystr, key) ) {
+		clear();
+		free(state_keystr);
+		if ( !(state_keystr = strdup(key)) )
+			err(EXIT_FAILURE, "strdup");
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+int state_enabled(void)
+{
+	return state_path != NULL;
+}
+
+/*
+ * Look up the record of the directory path. Returns 0 and fills *st if
+ * there is one.
+ */
+int state_get(const char *path, dstate_t *st)
+{
+	srec_t *r;
+	int ret = -1;
+
+	if (!state_path)
+		return -1;
+
+	pthread_mutex_lock(&lock);
+	if ( nslots && (r = *find(path)) ) {
+		r->seen = true;
+		*st = r->st;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+void state_put(const char *path, const dstate_t *st)
+{
+	srec_t *r;
+
+	if (!state_path)
+		return;
+
+	pthread_mutex_lock(&lock);
+	r = insert(path);
+	r->st = *st;
+	r->fresh = true;
+	r->gone = false;
+	pthread_mutex_unlock(&lock);
+}
+
+/* the directory path was removed */
+void state_forget(const char *path)
+{
+	srec_t *r;
+
+	if (!state_path)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if ( nslots && (r = *find(path)) )
+		r->gone = true;
+	pthread_mutex_unlock(&lock);
+}
+
+/* save, if it has been a while */
+void state_checkpoint(void)
+{
+	if (state_path && uptime() - last_save >= STATE_INTERVAL)
+		state_save();
+}
+
+static int rec_cmp(const void *a, const void *b)
+{
+	return strcmp((*(srec_t *const *)a)->path, (*(srec_t *const *)b)->path);
+}
+
+/*
+ * Whether r names a directory that is gone: it was removed, or its parent
+ * was rescanned
+ * since the last save, or is gone too, and r was not reached from it.
+ * Parents sort before their children, so theirs is already decided.
+ */
+static bool is_stale(const srec_t *r)
+{
+	char parent[PATH_MAX];
+	const char *slash;
+	srec_t *p;
+
+	if (r->gone)
+		return true;
+
+	if (r->seen || r->fresh || !(slash = strrchr(r->path, '/')) ||
+			slash == r->path || (size_t)(slash - r->path) >= sizeof(parent))
+		return false;
+
+	memcpy(parent, r->path, slash - r->path);
+	parent[slash - r->path] = '\0';
+
+	return (p = *find(parent)) && (p->fresh || p->drop);
+}
+
+static int save_locked(void)
+{
+	struct state_hdr hdr;
+	struct state_rec *recs = NULL;
+	srec_t **sorted = NULL;
+	char *strs = NULL, *tmp = NULL, *dir;
+	size_t i, n, strsz, off, len;
+	int fd = -1, ret = -1;
+
+	last_save = uptime();
+
+	if ( !(sorted = malloc((nused + 1) * sizeof(srec_t *))) ) {
+		log_warn("malloc");
+		goto done;
+	}
+
+	for (i = n = 0; i < nslots; i++)
+		if (slots[i])
+			sorted[n++] = slots[i];
+	qsort(sorted, n, sizeof(srec_t *), rec_cmp);
+
+	strsz = strlen(state_keystr) + 1;
+	for (i = 0; i < n; i++) {
+		sorted[i]->drop = is_stale(sorted[i]);
+		if (!sorted[i]->drop)
+			strsz += strlen(sorted[i]->path) + 1;
+	}
+
+	if ( !(recs = calloc(n + 1, sizeof(struct state_rec))) ||
+			!(strs = malloc(strsz)) ) {
+		log_warn("malloc");
+		goto done;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, STATE_MAGIC, sizeof(hdr.magic));
+	hdr.version = STATE_VERSION;
+	hdr.key = 0;
+	hdr.strsz = strsz;
+	off = strlen(state_keystr) + 1;
+	memcpy(strs, state_keystr, off);
+
+	for (i = 0; i < n; i++)
+	{
+		if (sorted[i]->drop)
+			continue;
+
+		len = strlen(sorted[i]->path) + 1;
+		memcpy(strs + off, sorted[i]->path, len);
+
+		recs[hdr.nrecs].path = off;
+		recs[hdr.nrecs].ino = sorted[i]->st.ino;
+		recs[hdr.nrecs].ctime_sec = sorted[i]->st.ctime_sec;
+		recs[hdr.nrecs].ctime_nsec = sorted[i]->st.ctime_nsec;
+		recs[hdr.nrecs].oldest_sec = sorted[i]->st.oldest_sec;
+		recs[hdr.nrecs].oldest_nsec = sorted[i]->st.oldest_nsec;
+		hdr.nrecs++;
+		off += len;
+	}
+
+	len = strlen(state_path) + sizeof(".XXXXXX");
+	if ( !(tmp = malloc(len)) ) {
+		log_warn("malloc");
+		goto done;
+	}
+
+	/* STATE_DIR is not there on a fresh system */
+	snprintf(tmp, len, "%s", state_path);
+	dir = dirname(tmp);
+	if ( access(dir, F_OK) && (fd = mkpath(dir, 0755)) != -1 )
+		close(fd);
+
+	snprintf(tmp, len, "%s.XXXXXX", state_path);
+	if ( (fd = mkstemp(tmp)) == -1 ) {
+		log_warn("mkstemp(%s)", tmp);
+		goto done;
+	}
+
+	if ( write_all(fd, &hdr, sizeof(hdr)) ||
+			write_all(fd, recs, sizeof(struct state_rec) * hdr.nrecs) ||
+			write_all(fd, strs, strsz) ) {
+		log_warn("write(%s)", tmp);
+		unlink(tmp);
+		goto done;
+	}
+
+	if ( fchmod(fd, S_IRUSR|S_IWUSR) )
+		log_warn("fchmod(%s)", tmp);
+
+	if ( close(fd) ) {
+		fd = -1;
+		log_warn("close(%s)", tmp);
+		unlink(tmp);
+		goto done;
+	}
+	fd = -1;
+
+	if ( rename(tmp, state_path) ) {
+		log_warn("rename(%s)", state_path);
+		unlink(tmp);
+		goto done;
+	}
+
+	/* forget what went, start marking afresh */
+	if (nslots)
+		memset(slots, 0, nslots * sizeof(srec_t *));
+	for (i = 0; i < n; i++) {
+		if (sorted[i]->drop) {
+			free(sorted[i]->path);
+			free(sorted[i]);
+			nused--;
+			continue;
+		}
+		sorted[i]->seen = sorted[i]->fresh = false;
+		*find(sorted[i]->path) = sorted[i];
+	}
+
+	ret = 0;
+
+done:
+	if (fd != -1)
+		close(fd);
+	free(tmp);
+	free(strs);
+	free(recs);
+	free(sorted);
+	return ret;
+}
+
+int state_save(void)
+{
+	int ret;
+
+	if (!state_path || !state_keystr)
+		return -1;
+
+	pthread_mutex_lock(&lock);
+	ret = save_locked();
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
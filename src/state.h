@@ -0,0 +1,31 @@
+#ifndef _STATE_H
+#define _STATE_H
+
+#include <stdint.h>
+
+/*
+ * What the last clean saw of one directory. oldest is the oldest
+ * timestamp anything left in or below it had, as the newest of each
+ * entry's timestamps; STATE_EMPTY if nothing was left.
+ */
+typedef struct dstate {
+	uint64_t ino;
+	int64_t ctime_sec;
+	uint32_t ctime_nsec;
+	int64_t oldest_sec;
+	uint32_t oldest_nsec;
+} dstate_t;
+
+#define STATE_EMPTY	INT64_MAX
+#define STATE_DIR	"/var/lib/tmpfilesd"
+
+void state_init(const char *path);
+void state_key(const char *key);
+int state_enabled(void);
+int state_get(const char *path, dstate_t *st);
+void state_put(const char *path, const dstate_t *st);
+void state_forget(const char *path);
+void state_checkpoint(void);
+int state_save(void);
+
+#endif
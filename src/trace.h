@@ -0,0 +1,48 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "config.h"
+
+/*
+ * USDT probes of the "tmpfilesd" provider. They cost a nop each unless a
+ * tracer is attached, and compile to nothing without <sys/sdt.h> or when
+ * configured with --disable-usdt.
+ *
+ *   rule__start(file, line, path, type)    before a rule is executed
+ *   rule__done(file, line, path, type)     after it
+ *   glob__start(pattern)
+ *   glob__done(pattern, matches)
+ *   mkpath__start(path)
+ *   mkpath__done(path, fd)                 fd is -1 on failure
+ *   clean__dir__start(path)                before a directory is read
+ *   clean__dir__done(path, incomplete)     after everything below it
+ *   clean__unlink(dir, name, res)          each entry cleaning removes,
+ *   clean__rmdir(path, res)                res 0 or -errno
+ *   rm__start(path, flags)                 r, R, D --remove and '+'
+ *   rm__done(path, res)
+ *
+ * The probes below a rule fire on the thread that executes it, between
+ * its rule__start and rule__done, e.g.:
+ *
+ *   bpftrace -e '
+ *     usdt:tmpfilesd:rule__start { @t[tid] = nsecs; }
+ *     usdt:tmpfilesd:rule__done /@t[tid]/ {
+ *       @us[str(arg0), arg1] = hist((nsecs - @t[tid]) / 1000);
+ *       delete(@t[tid]); }'
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define TRACE1(n, a)			DTRACE_PROBE1(tmpfilesd, n, a)
+#define TRACE2(n, a, b)			DTRACE_PROBE2(tmpfilesd, n, a, b)
+#define TRACE3(n, a, b, c)		DTRACE_PROBE3(tmpfilesd, n, a, b, c)
+#define TRACE4(n, a, b, c, d)	DTRACE_PROBE4(tmpfilesd, n, a, b, c, d)
+#else
+#define TRACE1(n, a)			do { } while (0)
+#define TRACE2(n, a, b)			do { } while (0)
+#define TRACE3(n, a, b, c)		do { } while (0)
+#define TRACE4(n, a, b, c, d)	do { } while (0)
+#endif
+
+#endif
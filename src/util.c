@@ -3,46 +3,39 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <err.h>
+#include <errno.h>
 #include <unistd.h>
 #include <ctype.h>
 
 #include "util.h"
+#include "log.h"
 
+/*
+ * Strip leading and trailing whitespace in place. The result starts at the
+ * same address as str, so it can still be passed to free().
+ */
 char *trim(char *str)
 {
 
 	if (str == NULL) {
-		warnx("str is NULL");
+		log_warnx("str is NULL");
 		return str;
 	}
 
-	char *ret = str;
-	int i, len;
+	size_t i, len;
 
 	len = strlen(str);
 
-	for (i = len - 1; i; i--)
-	{
-		if (isspace(str[i])) str[i] = '\0';
-		else break;
-	}
-	
-	len = strlen(str);
+	while (len && isspace((unsigned char)str[len - 1]))
+		str[--len] = '\0';
 
 	for (i = 0; i < len; i++)
-		if (!isspace(str[i])) break;
+		if (!isspace((unsigned char)str[i])) break;
 
-	if (i == 0) return str;
+	if (i)
+		memmove(str, str + i, len - i + 1);
 
-	if ( (ret = calloc(1, MAX(1, len - i))) == NULL )
-		warn("calloc");
-	else {
-		snprintf(ret, len, "%s", str + i);
-		free(str);
-	}
-
-	return ret;
+	return str;
 }
 
 int is_dot(const char *path)
@@ -63,7 +56,7 @@ char *pathcat(const char *a, const char *b)
 	char *ret = malloc(len);
 
 	if ( !ret ) {
-		warn("malloc");
+		log_warn("malloc");
 		return NULL;
 	}
 
@@ -75,6 +68,34 @@ char *pathcat(const char *a, const char *b)
 	return ret;
 }
 
+/*
+ * As pathcat() but into a caller supplied buffer. Returns NULL if the
+ * result does not fit.
+ */
+char *pathcpy(char *buf, size_t size, const char *a, const char *b)
+{
+	size_t alen, blen;
+	int sep;
+
+	if ( !buf || !a || !b ) return NULL;
+
+	alen = strlen(a);
+	blen = strlen(b);
+	sep = (*b != '/' && (!alen || a[alen-1] != '/'));
+
+	if (alen + sep + blen + 1 > size) {
+		log_warnx("path too long: %s%s%s", a, sep ? "/" : "", b);
+		return NULL;
+	}
+
+	memcpy(buf, a, alen);
+	if (sep)
+		buf[alen++] = '/';
+	memcpy(buf + alen, b, blen + 1);
+
+	return buf;
+}
+
 int isnumber(const char *t)
 {
 	size_t i;
@@ -86,4 +107,21 @@ int isnumber(const char *t)
 	return 1;
 }
 
+int write_all(int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+	ssize_t rc;
 
+	while (len)
+	{
+		if ( (rc = write(fd, ptr, len)) == -1 ) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		ptr += rc;
+		len -= rc;
+	}
+
+	return 0;
+}
@@ -4,8 +4,11 @@
 char *trim(char *str);
 int is_dot(const char *path);
 char *pathcat(const char *a, const char *b);
+char *pathcpy(char *buf, size_t size, const char *a, const char *b);
 int isnumber(const char *t);
-int mkpath(char *dir, mode_t mode);
+int write_all(int fd, const void *buf, size_t len);
+int mkpath(const char *dir, mode_t mode);
+void mkpath_forget(void);
 
 #define MAX(a, b) (a < b ? b : a)
 
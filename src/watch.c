@@ -0,0 +1,622 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "watch.h"
+#include "dirstream.h"
+#include "log.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+#ifdef HAVE_SYS_FANOTIFY_H
+# include <sys/fanotify.h>
+# include <sys/vfs.h>
+#endif
+
+/*
+ * Change notification for --daemon.
+ *
+ * Every directory of a cleaned tree gets a watch of its own, added as the
+ * tree is walked and as new directories appear in it, so only changes
+ * inside the trees are ever reported. With fanotify and
+ * FAN_REPORT_DFID_NAME (Linux 5.9, CAP_SYS_ADMIN) these are inode marks,
+ * and events name the directory by its file handle, which is looked up
+ * in a table filled from name_to_handle_at() as each mark is added and
+ * emptied again by FAN_DELETE_SELF as each marked directory goes.
+ * Otherwise inotify watches are used, where the watch descriptor says
+ * which directory it was.
+ *
+ * Writes to a file are not watched: they only make it younger, which
+ * never brings a cleanup forward.
+ *
+ * Walking a tree to watch it keeps at most WATCH_MAXFDS of its levels
+ * open, so a deep tree cannot use up the descriptors.
+ */
+
+#define WATCH_BUFSZ	(64 * 1024)
+#define WATCH_MAXFDS	128
+#define WATCH_TREE_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO| \
+		IN_ATTRIB|IN_EXCL_UNLINK|IN_ONLYDIR|IN_DONT_FOLLOW)
+#define WATCH_CONF_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO| \
+		IN_CLOSE_WRITE|IN_ONLYDIR)
+
+enum { W_NONE, W_INOTIFY, W_FANOTIFY };
+
+typedef struct wpath {
+	char *path;
+	size_t len;
+	unsigned flags;
+} wpath_t;
+
+/* a directory being walked by watch_below(), one per level */
+typedef struct wlevel {
+	dstream_t ds;
+	dev_t dev;
+	ino_t ino;
+	off_t pos;		/* of ds while its fd is closed */
+	struct wlevel *up;
+} wlevel_t;
+
+static int kind = W_NONE;
+static int wfd = -1;
+
+/* watched paths per inotify wd */
+static wpath_t *paths = NULL;
+static size_t npaths = 0;
+
+static int path_set(size_t i, const char *path, unsigned flags)
+{
+	wpath_t *tmp;
+	size_t n;
+
+	if (i >= npaths) {
+		n = i + 1 > npaths * 2 ? i + 1 : npaths * 2;
+		if ( !(tmp = realloc(paths, n * sizeof(wpath_t))) )
+			return -1;
+		memset(tmp + npaths, 0, (n - npaths) * sizeof(wpath_t));
+		paths = tmp;
+		npaths = n;
+	}
+
+	free(paths[i].path);
+	if ( !(paths[i].path = strdup(path)) )
+		return -1;
+	paths[i].len = strlen(path);
+	paths[i].flags = flags;
+
+	return 0;
+}
+
+static int add_tree(const char *path, unsigned flags);
+
+#ifdef HAVE_SYS_FANOTIFY_H
+
+#define FAN_TREE_MASK	(FAN_CREATE|FAN_DELETE|FAN_MOVE|FAN_ATTRIB|FAN_ONDIR| \
+		FAN_EVENT_ON_CHILD|FAN_DELETE_SELF)
+#define FAN_CONF_MASK	(FAN_CREATE|FAN_DELETE|FAN_MOVE|FAN_CLOSE_WRITE| \
+		FAN_ONDIR|FAN_EVENT_ON_CHILD)
+#define FH_MAX		128
+
+/* a marked directory: its fsid and file handle, and its path */
+typedef struct fhent {
+	unsigned char *key;
+	size_t keylen;
+	size_t hash;
+	char *path;
+	unsigned flags;
+} fhent_t;
+
+static fhent_t *fhtab = NULL;
+static size_t fhslots = 0, fhused = 0;
+
+static int fan_init(void)
+{
+	wfd = fanotify_init(FAN_CLASS_NOTIF|FAN_REPORT_DFID_NAME|FAN_CLOEXEC|
+			FAN_NONBLOCK, O_RDONLY|O_CLOEXEC);
+	return wfd == -1 ? -1 : 0;
+}
+
+static size_t fh_hash(const unsigned char *key, size_t len)
+{
+	size_t h = 2166136261u;
+
+	while (len--)
+		h = (h ^ *key++) * 16777619u;
+
+	return h;
+}
+
+static fhent_t *fh_slot(const unsigned char *key, size_t len, size_t h)
+{
+	size_t i;
+
+	for (i = h & (fhslots - 1); fhtab[i].key; i = (i + 1) & (fhslots - 1))
+		if (fhtab[i].hash == h && fhtab[i].keylen == len &&
+				!memcmp(fhtab[i].key, key, len))
+			break;
+
+	return &fhtab[i];
+}
+
+static int fh_grow(void)
+{
+	fhent_t *old = fhtab;
+	size_t i, oldsize = fhslots;
+
+	fhslots = fhslots ? fhslots * 2 : 256;
+	if ( !(fhtab = calloc(fhslots, sizeof(fhent_t))) ) {
+		fhtab = old;
+		fhslots = oldsize;
+		return -1;
+	}
+
+	for (i = 0; i < oldsize; i++)
+		if (old[i].key)
+			*fh_slot(old[i].key, old[i].keylen, old[i].hash) = old[i];
+
+	free(old);
+	return 0;
+}
+
+/* forget the directory of e, whose mark the kernel has dropped */
+static void fh_del(fhent_t *e)
+{
+	size_t mask = fhslots - 1, i = e - fhtab, j, home;
+
+	free(e->key);
+	free(e->path);
+
+	/* pull back later entries of the run that would no longer be found */
+	for (j = (i + 1) & mask; fhtab[j].key; j = (j + 1) & mask)
+	{
+		home = fhtab[j].hash & mask;
+		if ( ((j - home) & mask) >= ((j - i) & mask) ) {
+			fhtab[i] = fhtab[j];
+			i = j;
+		}
+	}
+
+	memset(&fhtab[i], 0, sizeof(fhent_t));
+	fhused--;
+}
+
+static void fh_flush(void)
+{
+	for (size_t i = 0; i < fhslots; i++) {
+		free(fhtab[i].key);
+		free(fhtab[i].path);
+	}
+	free(fhtab);
+	fhtab = NULL;
+	fhslots = fhused = 0;
+}
+
+/* remember which path the directory open on fd is */
+static int fh_put(int fd, const char *path, unsigned flags)
+{
+	struct {
+		struct file_handle fh;
+		unsigned char bytes[FH_MAX];
+	} h;
+	struct statfs sfs;
+	unsigned char *key;
+	size_t keylen, hash;
+	fhent_t *e;
+	int mnt;
+
+	h.fh.handle_bytes = FH_MAX;
+	if (name_to_handle_at(fd, "", &h.fh, &mnt, AT_EMPTY_PATH) == -1 ||
+			fstatfs(fd, &sfs) == -1)
+		return -1;
+
+	keylen = sizeof(fsid_t) + sizeof(h.fh) + h.fh.handle_bytes;
+	if ( !(key = malloc(keylen)) )
+		return -1;
+	memcpy(key, &sfs.f_fsid, sizeof(fsid_t));
+	memcpy(key + sizeof(fsid_t), &h.fh, sizeof(h.fh) + h.fh.handle_bytes);
+	hash = fh_hash(key, keylen);
+
+	if ((fhused + 1) * 2 > fhslots && fh_grow()) {
+		free(key);
+		return -1;
+	}
+
+	e = fh_slot(key, keylen, hash);
+	if (e->key) {
+		free(key);
+		free(e->path);
+	} else {
+		e->key = key;
+		e->keylen = keylen;
+		e->hash = hash;
+		fhused++;
+	}
+
+	e->flags = flags;
+	return (e->path = strdup(path)) ? 0 : -1;
+}
+
+static int fan_watch(int fd, const char *path, unsigned flags)
+{
+	if (fanotify_mark(wfd, FAN_MARK_ADD|FAN_MARK_ONLYDIR,
+				(flags & WATCH_TREE) ? FAN_TREE_MASK : FAN_CONF_MASK,
+				fd, NULL) == -1)
+		return -1;
+
+	return fh_put(fd, path, flags);
+}
+
+static void fan_reset(void)
+{
+	fh_flush();
+
+	/*
+	 * The group and its descriptor stay, the daemon polls it. Events
+	 * still queued for the old marks no longer match a handle and are
+	 * dropped by fan_read().
+	 */
+	if (fanotify_mark(wfd, FAN_MARK_FLUSH, 0, AT_FDCWD, NULL) == -1)
+		log_warn("fanotify_mark(FAN_MARK_FLUSH)");
+}
+
+static void fan_read(watch_fn fn)
+{
+	struct fanotify_event_metadata *m;
+	struct fanotify_event_info_fid *fid;
+	char buf[WATCH_BUFSZ] __attribute__((aligned(8)));
+	char sub[PATH_MAX];
+	struct file_handle *fh;
+	unsigned char *key;
+	const char *name;
+	size_t keylen;
+	fhent_t *e;
+	ssize_t len;
+
+	while ( (len = read(wfd, buf, sizeof(buf))) > 0 )
+	{
+		for (m = (void *)buf; FAN_EVENT_OK(m, len); m = FAN_EVENT_NEXT(m, len))
+		{
+			if (m->mask & FAN_Q_OVERFLOW) {
+				fn(NULL, WATCH_OVERFLOW);
+				continue;
+			}
+
+			if (m->event_len < sizeof(*m) + sizeof(*fid) || !fhused)
+				continue;
+
+			fid = (struct fanotify_event_info_fid *)(m + 1);
+			if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME &&
+					fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID)
+				continue;
+
+			/* the key is laid out as fh_put() builds it */
+			fh = (struct file_handle *)fid->handle;
+			key = (unsigned char *)&fid->fsid;
+			keylen = sizeof(fsid_t) + sizeof(*fh) + fh->handle_bytes;
+			if (sizeof(fid->fsid) != sizeof(fsid_t) ||
+					!(e = fh_slot(key, keylen, fh_hash(key, keylen)))->key)
+				continue;
+
+			/* its parent hears of it as a FAN_DELETE */
+			if (m->mask & FAN_DELETE_SELF) {
+				fh_del(e);
+				continue;
+			}
+
+			/* a new directory in a tree, watch it and what it holds */
+			name = (const char *)fh->f_handle + fh->handle_bytes;
+			if ((e->flags & WATCH_TREE) && (m->mask & FAN_ONDIR) &&
+					(m->mask & (FAN_CREATE|FAN_MOVED_TO)) &&
+					fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME &&
+					(size_t)snprintf(sub, sizeof(sub), "%s/%s", e->path,
+						name) < sizeof(sub)) {
+				if (add_tree(sub, WATCH_TREE))
+					log_warn("fanotify_mark(%s)", sub);
+				/* the table may have grown */
+				e = fh_slot(key, keylen, fh_hash(key, keylen));
+			}
+
+			fn(e->path, e->flags);
+		}
+	}
+}
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+static int ino_watch(const char *path, unsigned flags)
+{
+	int wd;
+
+	wd = inotify_add_watch(wfd, path, (flags & WATCH_TREE) ?
+			WATCH_TREE_MASK : WATCH_CONF_MASK);
+	if (wd == -1 || path_set(wd, path, flags))
+		return -1;
+
+	return 0;
+}
+#endif
+
+/* watch the directory path, which is open on fd */
+static int watch_dir(int fd, const char *path, unsigned flags)
+{
+	switch (kind)
+	{
+#ifdef HAVE_SYS_FANOTIFY_H
+		case W_FANOTIFY:	return fan_watch(fd, path, flags);
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+		case W_INOTIFY:		(void)fd; return ino_watch(path, flags);
+#endif
+		default:			return -1;
+	}
+}
+
+/* close the directory of l, to be reopened by unpark() */
+static void park(wlevel_t *l)
+{
+	if ( (l->pos = lseek(l->ds.fd, 0, SEEK_CUR)) == -1 )
+		return;
+
+	close(l->ds.fd);
+	l->ds.fd = -1;
+}
+
+/* reopen the parked directory of l from its child directory cfd */
+static int unpark(wlevel_t *l, int cfd)
+{
+	struct stat sb;
+	int fd;
+
+	if ( (fd = openat(cfd, "..", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1 )
+		return -1;
+
+	if (fstat(fd, &sb) == -1 || sb.st_dev != l->dev || sb.st_ino != l->ino ||
+			lseek(fd, l->pos, SEEK_SET) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	l->ds.fd = fd;
+	return 0;
+}
+
+/* watch every directory below path, which is open on dfd */
+static int watch_below(int dfd, char *path, size_t plen, wlevel_t *up)
+{
+	wlevel_t lv = { .up = up }, *p;
+	struct stat sb;
+	dsent_t ent;
+	size_t nlen;
+	int fd, i, ret = 0;
+
+	if (fstat(dfd, &sb) == -1) {
+		close(dfd);
+		return -1;
+	}
+	lv.dev = sb.st_dev;
+	lv.ino = sb.st_ino;
+
+	if (ds_open(&lv.ds, dfd, WATCH_BUFSZ / 4))
+		return -1;
+
+	for (p = &lv, i = 0; p && i < WATCH_MAXFDS; i++)
+		p = p->up;
+	if (p && p->ds.fd != -1)
+		park(p);
+
+	/* a parent that could not be reopened ends the walk */
+	while (lv.ds.fd != -1 && ds_next(&lv.ds, &ent) == 1)
+	{
+		if (ent.type != DT_DIR && ent.type != DT_UNKNOWN)
+			continue;
+
+		nlen = strlen(ent.name);
+		if (plen + nlen + 2 > PATH_MAX) {
+			ret = -1;
+			continue;
+		}
+
+		path[plen] = '/';
+		memcpy(path + plen + 1, ent.name, nlen + 1);
+
+		if ( (fd = openat(lv.ds.fd, ent.name,
+						O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1 ) {
+			if (errno != ENOTDIR && errno != ENOENT && errno != ELOOP)
+				ret = -1;
+			continue;
+		}
+
+		if (watch_dir(fd, path, WATCH_TREE)) {
+			close(fd);
+			ret = -1;
+			continue;
+		}
+
+		ret |= watch_below(fd, path, plen + 1 + nlen, &lv);
+	}
+
+	if (lv.ds.fd == -1)
+		ret = -1;
+	else if (up && up->ds.fd == -1 && unpark(up, lv.ds.fd))
+		ret = -1;
+
+	path[plen] = '\0';
+	ds_close(&lv.ds);
+	return ret;
+}
+
+static int add_tree(const char *path, unsigned flags)
+{
+	char buf[PATH_MAX];
+	int fd;
+
+	if ( (fd = open(path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1 )
+		return -1;
+
+	if (watch_dir(fd, path, flags)) {
+		close(fd);
+		return -1;
+	}
+
+	if ( !(flags & WATCH_TREE) ) {
+		close(fd);
+		return 0;
+	}
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	return watch_below(fd, buf, strlen(buf), NULL);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static void ino_read(watch_fn fn)
+{
+	char buf[WATCH_BUFSZ] __attribute__((aligned(8)));
+	char sub[PATH_MAX];
+	struct inotify_event *ev;
+	wpath_t *w;
+	ssize_t len, i;
+	size_t nlen;
+
+	while ( (len = read(wfd, buf, sizeof(buf))) > 0 )
+	{
+		for (i = 0; i < len; i += sizeof(*ev) + ev->len)
+		{
+			ev = (struct inotify_event *)(buf + i);
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				fn(NULL, WATCH_OVERFLOW);
+				continue;
+			}
+
+			if (ev->wd < 0 || (size_t)ev->wd >= npaths ||
+					!(w = &paths[ev->wd])->path)
+				continue;
+
+			if (ev->mask & IN_IGNORED) {
+				free(w->path);
+				w->path = NULL;
+				continue;
+			}
+
+			/* a new directory in a tree, watch it and what it holds */
+			if ((w->flags & WATCH_TREE) && (ev->mask & IN_ISDIR) && ev->len &&
+					(ev->mask & (IN_CREATE|IN_MOVED_TO)) &&
+					w->len + (nlen = strlen(ev->name)) + 2 <= sizeof(sub)) {
+				memcpy(sub, w->path, w->len);
+				sub[w->len] = '/';
+				memcpy(sub + w->len + 1, ev->name, nlen + 1);
+				if (add_tree(sub, WATCH_TREE))
+					log_warn("inotify_add_watch(%s)", sub);
+				w = &paths[ev->wd];	/* paths may have moved */
+			}
+
+			fn(w->path, w->flags);
+		}
+	}
+}
+#endif
+
+/*
+ * Returns:
+ * a descriptor to poll() for events, or -1 if neither fanotify nor
+ * inotify can be used.
+ */
+int watch_init(void)
+{
+#ifdef HAVE_SYS_FANOTIFY_H
+	if (!fan_init()) {
+		kind = W_FANOTIFY;
+		return wfd;
+	}
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+	if ( (wfd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) != -1 ) {
+		kind = W_INOTIFY;
+		return wfd;
+	}
+#endif
+	return -1;
+}
+
+const char *watch_kind(void)
+{
+	switch (kind)
+	{
+		case W_FANOTIFY:	return "fanotify";
+		case W_INOTIFY:		return "inotify";
+		default:			return "none";
+	}
+}
+
+/*
+ * Start watching path. Returns -1 if changes in some part of it will not
+ * be noticed.
+ */
+int watch_add(const char *path, unsigned flags)
+{
+	switch (kind)
+	{
+#ifdef HAVE_SYS_FANOTIFY_H
+		case W_FANOTIFY:
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+		case W_INOTIFY:
+#endif
+			return add_tree(path, flags);
+		default:
+			return -1;
+	}
+}
+
+/*
+ * Stop watching anything, e.g. before the set of paths is rebuilt.
+ */
+void watch_reset(void)
+{
+	for (size_t i = 0; i < npaths; i++)
+	{
+#ifdef HAVE_SYS_INOTIFY_H
+		if (kind == W_INOTIFY && paths[i].path)
+			inotify_rm_watch(wfd, i);
+#endif
+		free(paths[i].path);
+	}
+	free(paths);
+	paths = NULL;
+	npaths = 0;
+
+#ifdef HAVE_SYS_FANOTIFY_H
+	if (kind == W_FANOTIFY)
+		fan_reset();
+#endif
+}
+
+/*
+ * Drain pending events, calling fn for each one about a watched path.
+ */
+void watch_read(watch_fn fn)
+{
+	switch (kind)
+	{
+#ifdef HAVE_SYS_FANOTIFY_H
+		case W_FANOTIFY:	fan_read(fn); break;
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+		case W_INOTIFY:		ino_read(fn); break;
+#endif
+		default:			break;
+	}
+}
@@ -0,0 +1,17 @@
+#ifndef _WATCH_H
+#define _WATCH_H
+
+#define WATCH_CONFIG	0x01	/* a config directory, entries only */
+#define WATCH_TREE		0x02	/* a cleaned directory and all below it */
+#define WATCH_OVERFLOW	0x04	/* events were lost, anything may have changed */
+
+/* dir is the directory in which something changed */
+typedef void (*watch_fn)(const char *dir, unsigned flags);
+
+int watch_init(void);
+const char *watch_kind(void);
+int watch_add(const char *path, unsigned flags);
+void watch_reset(void);
+void watch_read(watch_fn fn);
+
+#endif
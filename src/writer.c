@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "writer.h"
+#include "log.h"
+
+/*
+ * w and w+ write their argument into existing files, mostly attributes
+ * under /sys and /proc/sys. Each file is opened once and gets the whole
+ * argument in a single write(), as a sysfs attribute takes one value per
+ * write. A glob that matches many files, say a queue attribute of every
+ * disk, has them written by up to jobs threads, so one slow device does
+ * not hold up the others; rules on unrelated paths already run
+ * concurrently in the executor.
+ */
+
+typedef struct wjob {
+	char **paths;
+	size_t n;
+	size_t next;
+	size_t failed;
+	const char *data;
+	size_t len;
+	int flags;
+} wjob_t;
+
+static bool write_one(const char *path, const char *data, size_t len, int flags)
+{
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, flags)) == -1) {
+		log_warn("open(%s)", path);
+		return false;
+	}
+
+	if ((n = write(fd, data, len)) != (ssize_t)len) {
+		if (n != -1)
+			errno = EIO;
+		log_warn("write(%s)", path);
+		close(fd);
+		return false;
+	}
+
+	if (close(fd) == -1) {
+		log_warn("close(%s)", path);
+		return false;
+	}
+
+	return true;
+}
+
+static void *worker(void *arg)
+{
+	wjob_t *j = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->n)
+		if (!write_one(j->paths[i], j->data, j->len, j->flags))
+			__atomic_add_fetch(&j->failed, 1, __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+/*
+ * Write len bytes of data to each of the n paths, which have to exist,
+ * appending with append. Returns how many could not be written.
+ */
+size_t write_files(char **paths, size_t n, const char *data, size_t len,
+		bool append, unsigned jobs)
+{
+	wjob_t j = {
+		.paths = paths,
+		.n = n,
+		.data = data,
+		.len = len,
+		.flags = O_WRONLY|O_NOCTTY|O_CLOEXEC | (append ? O_APPEND : 0),
+	};
+	pthread_t threads[16];
+	unsigned i, started = 0;
+
+	if (jobs > n)
+		jobs = n;
+	if (jobs > sizeof(threads) / sizeof(threads[0]) + 1)
+		jobs = sizeof(threads) / sizeof(threads[0]) + 1;
+
+	/* the calling thread is one of the jobs */
+	for (i = 1; i < jobs; i++)
+		if (!pthread_create(&threads[started], NULL, worker, &j))
+			started++;
+
+	worker(&j);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	return j.failed;
+}
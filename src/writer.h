@@ -0,0 +1,10 @@
+#ifndef _WRITER_H
+#define _WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+size_t write_files(char **paths, size_t n, const char *data, size_t len,
+		bool append, unsigned jobs);
+
+#endif
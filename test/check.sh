@@ -0,0 +1,174 @@
+#!/usr/bin/env bash
+#
+# Check the syscalls each rule type costs against test/syscalls.budget.
+#
+# Usage: test/check.sh TMPFILESD SCCOUNT [BUDGET]
+#
+# Every case below builds a fresh --root fixture, runs one config line
+# against it under sccount and subtracts a run of the same flags with an
+# empty config, leaving what parsing and executing the line cost. A case
+# fails the check when a run exits non-zero or hangs, when the tree is
+# not what the line should have left behind, or when it is over its
+# budget, so a rule that gives up early cannot pass as a cheap one.
+# With UPDATE=1 the budget file is
+# rewritten with the measured counts instead, to be reviewed and
+# committed along with a change that lowers them.
+
+set -o errexit
+set -o nounset
+
+BIN=$(realpath "$1")
+SCCOUNT=$(realpath "$2")
+BUDGET=${3:-$(dirname "$0")/syscalls.budget}
+WORK=$(mktemp -d)
+trap 'unpin; rm -rf "${WORK}"' EXIT
+
+fail=0
+measured=
+pinned=()
+
+# files DIR N: N empty files below DIR, ten to a subdirectory
+files()
+{
+	local i
+
+	for ((i = 0; i < $2; i++)); do
+		mkdir -p "$1/s$((i / 10))"
+		: > "$1/s$((i / 10))/f${i}"
+	done
+}
+
+# deep DIR N: a chain of N directories below DIR, with a file at the
+# bottom that cannot be removed
+deep()
+{
+	local d=$1 i
+
+	for ((i = 0; i < $2; i++)); do
+		d+=/d
+	done
+	mkdir -p "${d}"
+	: > "${d}/leaf"
+	pin "${d}/leaf"
+}
+
+# pin FILE: make FILE impossible to remove, immutable where the file
+# system allows it, else by taking away write access to its directory
+pin()
+{
+	chattr +i "$1" 2>/dev/null || chmod a-w "$(dirname "$1")"
+	pinned+=("$1")
+}
+
+unpin()
+{
+	local f
+
+	for f in ${pinned[@]+"${pinned[@]}"}; do
+		chattr -i "${f}" 2>/dev/null || true
+		chmod u+w "$(dirname "${f}")" 2>/dev/null || true
+	done
+	pinned=()
+}
+
+# count ROOT FLAGS...: syscalls of one run, its exit status goes to
+# ${WORK}/status and what it logged to ${WORK}/log
+count()
+{
+	local root=$1 rc=0
+
+	shift
+	timeout 60 "${SCCOUNT}" -o "${WORK}/count" "${BIN}" --root="${root}" \
+		--jobs=1 --backend=sync "$@" >"${WORK}/log" 2>&1 || rc=$?
+	echo "${rc}" > "${WORK}/status"
+	cat "${WORK}/count" 2>/dev/null || echo 0
+}
+
+# check NAME SETUP LINE POST FLAGS...: POST is a test run in the tree
+# afterwards
+check()
+{
+	local name=$1 setup=$2 line=$3 post=$4 root=${WORK}/root base used budget
+
+	shift 4
+	unpin
+	rm -rf "${root}"
+	mkdir -p "${root}/etc/tmpfiles.d"
+	: > "${root}/etc/tmpfiles.d/check.conf"
+	base=$(count "${root}" "$@")
+
+	eval "${setup}"
+	echo "${line}" > "${root}/etc/tmpfiles.d/check.conf"
+	used=$(( $(count "${root}" "$@") - base ))
+	measured+=$(printf "%-12s %6d" "${name}" "${used}")$'\n'
+
+	budget=$(awk -v n="${name}" '$1 == n { print $2 }' "${BUDGET}")
+	if [[ $(< "${WORK}/status") != 0 ]]; then
+		printf "%-12s %6d %6s  FAIL (exit %s)\n" "${name}" "${used}" \
+			"${budget:--}" "$(< "${WORK}/status")"
+		sed 's/^/\t/' "${WORK}/log"
+		fail=1
+	elif ! ( cd "${root}" && eval "${post}" ); then
+		printf "%-12s %6d %6s  FAIL (%s)\n" "${name}" "${used}" \
+			"${budget:--}" "${post}"
+		sed 's/^/\t/' "${WORK}/log"
+		fail=1
+	elif [[ -z "${budget}" ]]; then
+		printf "%-12s %6d %6s  FAIL (no budget)\n" "${name}" "${used}" -
+		fail=1
+	elif ((used > budget)); then
+		printf "%-12s %6d %6d  FAIL\n" "${name}" "${used}" "${budget}"
+		fail=1
+	else
+		printf "%-12s %6d %6d  ok\n" "${name}" "${used}" "${budget}"
+	fi
+}
+
+printf "%-12s %6s %6s\n" "# case" used budget
+
+check d        ''                              'd /a/b/c 0755 - -' \
+	'[[ $(stat -c %a a/b/c) == 755 ]]'                      --create
+check d-exist  'mkdir -p "${root}/a/b/c"'      'd /a/b/c 0755 - -' \
+	'[[ $(stat -c %a a/b/c) == 755 ]]'                      --create
+check f        ''                              'f /f 0644 - -' \
+	'[[ -f f && $(stat -c %a f) == 644 ]]'                   --create
+check F        'echo old > "${root}/f"'        'F /f 0644 - - - new' \
+	'[[ -f f && ! -s f ]]'                                  --create
+check w        ': > "${root}/w"'               'w /w - - - - data' \
+	'[[ $(< w) == data ]]'                                  --create
+check L        ''                              'L /l - - - - /target' \
+	'[[ $(readlink l) == "${root}/target" ]]'               --create
+check p        ''                              'p /p 0644 - -' \
+	'[[ -p p ]]'                                            --create
+check c        ''                              'c /c 0666 - - - 1:3' \
+	'[[ -c c && $(stat -c %t:%T c) == 1:3 ]]'               --create
+check z        ': > "${root}/z"'               'z /z 0600 - -' \
+	'[[ $(stat -c %a z) == 600 ]]'                          --create
+# Z does not descend yet, so only the directory itself is looked at
+check Z        'mkdir "${root}/z"'             'Z /z 0700 - -' \
+	'[[ $(stat -c %a z) == 700 ]]'                          --create
+check r        ': > "${root}/r"'               'r /r' \
+	'[[ ! -e r ]]'                                          --remove
+check R        'files "${root}/t" 100'         'R /t' \
+	'[[ ! -e t ]]'                                          --remove
+# more levels than rmtree keeps open, with something left at the bottom
+check R-deep   'files "${root}/t" 10; deep "${root}/t" 140' 'R /t' \
+	'[[ $(find t -name leaf | wc -l) == 1 && ! -e t/s0 ]]'  --remove
+check C        'files "${root}/s" 100'         'C /c - - - - /s' \
+	'diff -r s c'                                           --create
+check clean    'files "${root}/t" 100'         'd /t - - - 0' \
+	'[[ -d t && -z $(ls -A t) ]]'                           --clean
+check clean-age 'files "${root}/t" 100'        'd /t - - - 1d' \
+	'[[ $(find t -type f | wc -l) == 100 ]]'                --clean
+
+if [[ -n "${UPDATE:-}" ]]; then
+	{
+		sed -n '/^#/p' "${BUDGET}"
+		printf "%s" "${measured}"
+	} > "${BUDGET}.new"
+	mv "${BUDGET}.new" "${BUDGET}"
+	echo "updated ${BUDGET}"
+	exit 0
+fi
+
+exit ${fail}
@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/ptrace.h>
+
+/*
+ * Count the system calls made by a command and all of its threads.
+ *
+ * The command is run under ptrace and every syscall-entry stop is
+ * counted, using PTRACE_GET_SYSCALL_INFO (Linux 5.3) to tell entry from
+ * exit stops. The total goes to FILE, or stderr, so the command keeps
+ * its own output; with -v a count per syscall number follows it.
+ *
+ * Usage: sccount [-v] [-o FILE] COMMAND [ARG]...
+ */
+
+#define NR_MAX	1024
+
+static unsigned long per_nr[NR_MAX];
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: sccount [-v] [-o FILE] COMMAND [ARG]...\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ptrace_syscall_info si;
+	unsigned long total = 0;
+	FILE *out = stderr;
+	int verbose = 0, status, rc = 0, opt;
+	pid_t child, pid;
+
+	while ((opt = getopt(argc, argv, "+vo:")) != -1)
+		switch (opt) {
+			case 'v':
+				verbose = 1;
+				break;
+			case 'o':
+				if ((out = fopen(optarg, "w")) == NULL)
+					err(2, "%s", optarg);
+				break;
+			default:
+				usage();
+		}
+
+	if (optind >= argc)
+		usage();
+
+	if ((child = fork()) == -1)
+		err(2, "fork");
+
+	if (!child) {
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1)
+			err(127, "ptrace");
+		raise(SIGSTOP);
+		execvp(argv[optind], &argv[optind]);
+		err(127, "%s", argv[optind]);
+	}
+
+	if (waitpid(child, &status, 0) == -1)
+		err(2, "waitpid");
+
+	if (ptrace(PTRACE_SETOPTIONS, child, NULL, PTRACE_O_TRACESYSGOOD |
+				PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK |
+				PTRACE_O_TRACEVFORK | PTRACE_O_TRACEEXEC |
+				PTRACE_O_EXITKILL) == -1)
+		err(2, "ptrace");
+
+	if (ptrace(PTRACE_SYSCALL, child, NULL, NULL) == -1)
+		err(2, "ptrace");
+
+	while ((pid = waitpid(-1, &status, __WALL)) != -1) {
+		int sig = 0;
+
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			if (pid == child)
+				rc = WIFEXITED(status) ? WEXITSTATUS(status)
+					: 128 + WTERMSIG(status);
+			continue;
+		}
+
+		if (!WIFSTOPPED(status))
+			continue;
+
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+			if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(si), &si) > 0 &&
+					si.op == PTRACE_SYSCALL_INFO_ENTRY) {
+				total++;
+				if (si.entry.nr < NR_MAX)
+					per_nr[si.entry.nr]++;
+			}
+		} else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP) {
+			/* a real signal, not an event stop or a new thread */
+			sig = WSTOPSIG(status);
+		}
+
+		ptrace(PTRACE_SYSCALL, pid, NULL, sig);
+	}
+
+	if (errno != ECHILD)
+		err(2, "waitpid");
+
+	fprintf(out, "%lu\n", total);
+	if (verbose)
+		for (int i = 0; i < NR_MAX; i++)
+			if (per_nr[i])
+				fprintf(out, "%d %lu\n", i, per_nr[i]);
+
+	if (out != stderr)
+		fclose(out);
+
+	return rc;
+}